@@ -37,7 +37,7 @@ class SkeletonMesh {
 
 		/*  Functions  */
 		// constructor
-		SkeletonMesh(std::vector<Vertex> vertices, std::vector<VertexBoneData> vbd, std::vector<unsigned int> indices, std::vector<glm::mat4> offsetMatricies)
+		SkeletonMesh(std::vector<Vertex> vertices, std::vector<VertexBoneData> vbd, std::vector<unsigned int> indices, std::vector<glm::mat4> offsetMatricies, bool uploadToGPU = true) : VAO{0}, VBO{0}, boneVB{0}, EBO{0}
 		{
 			this->vertices = vertices;
 			this->vbd = vbd;
@@ -45,7 +45,9 @@ class SkeletonMesh {
 			this->offsetMatricies = offsetMatricies;
 
 			// now that we have all the required data, set the vertex buffers and its attribute pointers.
-			setupMesh();
+			// CPU only users keep the data without touching OpenGL
+			if (uploadToGPU)
+				setupMesh();
 		}
 
 		// render the mesh
@@ -57,6 +59,36 @@ class SkeletonMesh {
 			glBindVertexArray(0);
 		}
 
+		// free the vertex array and buffers, the mesh data stays on the CPU
+		void Release()
+		{
+			if (VAO == 0)
+				return;
+			glDeleteVertexArrays(1, &VAO);
+			glDeleteBuffers(1, &VBO);
+			glDeleteBuffers(1, &boneVB);
+			glDeleteBuffers(1, &EBO);
+			VAO = VBO = boneVB = EBO = 0;
+		}
+
+		// a new vertex array over the mesh buffers with only the position and bone weight attributes, for users that
+		// add attributes of their own, the caller deletes it
+		unsigned int CreateVertexArray() const
+		{
+			unsigned int vao;
+			glCreateVertexArrays(1, &vao);
+			glVertexArrayVertexBuffer(vao, 0, VBO, 0, sizeof(Vertex));
+			glEnableVertexArrayAttrib(vao, 0);
+			glVertexArrayAttribFormat(vao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+			glVertexArrayAttribBinding(vao, 0, 0);
+			glVertexArrayVertexBuffer(vao, 1, boneVB, 0, sizeof(VertexBoneData));
+			glEnableVertexArrayAttrib(vao, 1);
+			glVertexArrayAttribFormat(vao, 1, 4, GL_FLOAT, GL_FALSE, 0);
+			glVertexArrayAttribBinding(vao, 1, 1);
+			glVertexArrayElementBuffer(vao, EBO);
+			return vao;
+		}
+
 	private:
 		/*  Render data  */
 		unsigned int VBO, boneVB, EBO;
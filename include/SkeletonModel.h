@@ -26,15 +26,17 @@ class SkeletonModel
 {
 	public:
 		/* Dummy constructor */
-		SkeletonModel() {}
+		SkeletonModel() : uploadToGPU{true} {}
 		
 		/*  Model Data */
 		std::vector<SkeletonMesh> meshes;
 		std::string directory;
+		// false keeps the meshes on the CPU only, for the software rasterizer
+		bool uploadToGPU;
 
 		/*  Functions   */
 		// constructor, expects a filepath to a 3D model.
-		SkeletonModel(std::string const &path)
+		SkeletonModel(std::string const &path, bool uploadToGPU = true) : uploadToGPU{uploadToGPU}
 		{
 			loadModel(path);
 		}
@@ -47,6 +49,13 @@ class SkeletonModel
 				meshes[i].Draw();
 		}
 
+		// frees the GL objects of all its meshes
+		void Release()
+		{
+			for(unsigned int i = 0; i < meshes.size(); i++)
+				meshes[i].Release();
+		}
+
 	private:
 		/*  Functions   */
 		// loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
@@ -148,7 +157,7 @@ class SkeletonModel
 				}
 			}
 
-			return SkeletonMesh(vertices, vbd, indices, offsetMatricies);
+			return SkeletonMesh(vertices, vbd, indices, offsetMatricies, uploadToGPU);
 		}
 		
 };
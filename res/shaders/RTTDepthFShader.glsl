@@ -0,0 +1,16 @@
+#version 460 core
+
+precision mediump float;
+
+uniform int atlasColumns;
+
+flat in int instanceid;
+
+void main()
+{
+	vec2 lowerBound = 128.0*vec2(float(instanceid % atlasColumns), float(instanceid / atlasColumns));
+	vec2 upperBound = lowerBound+128.0;
+	if (any(lessThan(gl_FragCoord.xy, lowerBound)) || any(greaterThan(gl_FragCoord.xy, upperBound))) {
+		discard;
+	}
+}
@@ -5,6 +5,7 @@ precision mediump float;
 // Output data
 uniform float zNear;
 uniform float zFar;
+uniform int atlasColumns;
 
 flat in int instanceid;
 
@@ -12,9 +13,9 @@ out vec4 FragColor;
 
 void main()
 {
-	float lowerBound = 128.0*float(instanceid);
-	float upperBound = lowerBound+128.0;
-	if ((gl_FragCoord.x <	lowerBound) || (gl_FragCoord.x > upperBound)) {
+	vec2 lowerBound = 128.0*vec2(float(instanceid % atlasColumns), float(instanceid / atlasColumns));
+	vec2 upperBound = lowerBound+128.0;
+	if (any(lessThan(gl_FragCoord.xy, lowerBound)) || any(greaterThan(gl_FragCoord.xy, upperBound))) {
 		discard;
 	}
 	float zTrans = 2.0 * gl_FragCoord.z - 1.0;
@@ -0,0 +1,18 @@
+#version 460 core
+
+uniform float zNear;
+uniform float zFar;
+
+flat in int triangleID;
+in vec3 barycentric;
+
+// triangle, the barycentrics of its second and third corner, and the linear depth RTTFShader.glsl writes
+out vec4 FragColor;
+
+void main()
+{
+	float zTrans = 2.0 * gl_FragCoord.z - 1.0;
+	float linearDepth = 2.0 * zNear * zFar / (zFar + zNear - zTrans * (zFar - zNear));
+	gl_FragDepth = linearDepth;
+	FragColor = vec4(float(triangleID), barycentric.y, barycentric.z, linearDepth);
+}
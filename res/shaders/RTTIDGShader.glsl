@@ -0,0 +1,22 @@
+#version 460 core
+
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+flat out int triangleID;
+out vec3 barycentric;
+
+// every corner gets its unit barycentric, the perspective correct interpolation then gives the weights of the
+// surface point behind each fragment
+void main()
+{
+	for (int i = 0; i < 3; i++)
+	{
+		gl_Position = gl_in[i].gl_Position;
+		triangleID = gl_PrimitiveIDIn;
+		barycentric = vec3(0.0);
+		barycentric[i] = 1.0;
+		EmitVertex();
+	}
+	EndPrimitive();
+}
@@ -0,0 +1,8 @@
+#version 460 core
+
+precision mediump float;
+
+// depth only, nothing to write
+void main()
+{
+}
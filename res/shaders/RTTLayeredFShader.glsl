@@ -0,0 +1,16 @@
+#version 460 core
+
+precision mediump float;
+
+// Output data
+uniform float zNear;
+uniform float zFar;
+
+// linear depth into the particle's R32F color layer, leaving gl_FragDepth alone keeps early depth testing on
+out float linearDepth;
+
+void main()
+{
+	float zTrans = 2.0 * gl_FragCoord.z - 1.0;
+	linearDepth = 2.0 * zNear * zFar / (zFar + zNear - zTrans * (zFar - zNear));
+}
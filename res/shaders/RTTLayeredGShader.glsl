@@ -0,0 +1,24 @@
+#version 460 core
+
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+flat in int vertexInstanceid[];
+
+flat out int instanceid;
+
+// the fused energy relies on the depth pre-pass and scoring pass rasterizing identically
+invariant gl_Position;
+
+void main()
+{
+	// route the triangle to the layer of its particle, the layer bounds clip it in hardware
+	for (int i = 0; i < 3; i++)
+	{
+		gl_Position = gl_in[i].gl_Position;
+		gl_Layer = vertexInstanceid[0];
+		instanceid = vertexInstanceid[0];
+		EmitVertex();
+	}
+	EndPrimitive();
+}
@@ -0,0 +1,27 @@
+#version 460 core
+
+layout(location = 0) in vec4 aPos;
+layout(location = 1) in vec4 boneweights;
+layout(location = 3) in mat4 instanceMatrix;
+layout(location = 7) in mat4 toerotMatrix;
+layout(location = 11) in mat4 legrotMatrix;
+
+uniform mat4 u_M;
+uniform mat4 u_P;
+
+uniform mat4 m2btoe;
+uniform mat4 m2bleg;
+uniform mat4 b2mtoe;
+uniform mat4 b2mleg;
+
+flat out int vertexInstanceid;
+
+void main()
+{
+	mat4 bonetransform = boneweights.z*b2mtoe*toerotMatrix*m2btoe;
+	bonetransform = bonetransform + boneweights.x*b2mleg*legrotMatrix*m2bleg;
+	bonetransform = bonetransform + (boneweights.y + boneweights.w)*mat4(1.0);
+	// no squash, every particle gets the full 128x128 viewport of its own layer
+	gl_Position = u_P * instanceMatrix *bonetransform*aPos;
+	vertexInstanceid = gl_InstanceID;
+}
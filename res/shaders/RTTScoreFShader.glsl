@@ -0,0 +1,41 @@
+#version 460 core
+
+precision mediump float;
+
+// Only run for fragments that match the depth pre-pass
+layout(early_fragment_tests) in;
+
+uniform float zNear;
+uniform float zFar;
+
+uniform sampler2D refTexture;
+uniform int atlasColumns;
+uniform int firstParticle;
+
+flat in int instanceid;
+
+// Per particle sum of (|ref - rendered| - |ref - 1.0|) in 16.16 fixed point
+layout(std430, binding = 0) buffer EnergyBuffer
+{
+	int energies[];
+};
+
+void main()
+{
+	vec2 lowerBound = 128.0*vec2(float(instanceid % atlasColumns), float(instanceid / atlasColumns));
+	vec2 upperBound = lowerBound+128.0;
+	if (any(lessThan(gl_FragCoord.xy, lowerBound)) || any(greaterThan(gl_FragCoord.xy, upperBound))) {
+		return;
+	}
+	float zTrans = 2.0 * gl_FragCoord.z - 1.0;
+	float rendered = 2.0 * zNear * zFar / (zFar + zNear - zTrans * (zFar - zNear));
+
+	// the reference is sampled upside down, the same way the subtraction pass does
+	ivec2 local = ivec2(gl_FragCoord.xy - lowerBound);
+	ivec2 texel = ivec2(local.x, 127 - local.y);
+	float ref = texelFetch(refTexture, texel, 0).r;
+
+	// uncovered pixels are already counted against the cleared depth of 1.0
+	float delta = abs(ref - rendered) - abs(ref - 1.0);
+	atomicAdd(energies[firstParticle + instanceid], int(round(delta * 65536.0)));
+}
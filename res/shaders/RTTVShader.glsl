@@ -2,12 +2,12 @@
 
 layout(location = 0) in vec4 aPos;
 layout(location = 1) in vec4 boneweights;
-layout(location = 2) in float aOffset;
 layout(location = 3) in mat4 instanceMatrix;
 layout(location = 7) in mat4 toerotMatrix;
 layout(location = 11) in mat4 legrotMatrix;
 
-uniform int instances;
+uniform int atlasColumns;
+uniform int atlasRows;
 uniform mat4 u_M;
 uniform mat4 u_P;
 
@@ -18,13 +18,19 @@ uniform mat4 b2mleg;
 
 flat out int instanceid;
 
+// the fused energy relies on the depth pre-pass and scoring pass rasterizing identically
+invariant gl_Position;
+
 void main()
 {
 	mat4 bonetransform = boneweights.z*b2mtoe*toerotMatrix*m2btoe;
 	bonetransform = bonetransform + boneweights.x*b2mleg*legrotMatrix*m2bleg;
 	bonetransform = bonetransform + (boneweights.y + boneweights.w)*mat4(1.0);
 	vec4 pos = u_P * instanceMatrix *bonetransform*aPos;
-	float xPos = pos.x/float(instances) + pos.w*(aOffset - 1.0 + (1.0/float(instances)));
-	gl_Position = vec4(xPos, pos.y, pos.z, pos.w);
+	// squash the particle into its tile of the atlas
+	vec2 tiles = vec2(float(atlasColumns), float(atlasRows));
+	vec2 tile = vec2(float(gl_InstanceID % atlasColumns), float(gl_InstanceID / atlasColumns));
+	vec2 xyPos = pos.xy/tiles + pos.w*(2.0*tile/tiles - 1.0 + (1.0/tiles));
+	gl_Position = vec4(xyPos, pos.z, pos.w);
 	instanceid = gl_InstanceID;
 }
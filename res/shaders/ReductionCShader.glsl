@@ -0,0 +1,56 @@
+#version 460 core
+
+// One work group per particle tile
+layout(local_size_x = 16, local_size_y = 16) in;
+
+uniform sampler2D depthTexture;
+uniform sampler2D refTexture;
+uniform int tileSize;
+uniform int atlasColumns;
+uniform int firstParticle;
+
+layout(std430, binding = 0) buffer EnergyBuffer
+{
+	float energies[];
+};
+
+shared float partialSums[256];
+
+void main()
+{
+	int tileIndex = int(gl_WorkGroupID.x);
+	ivec2 tileOrigin = tileSize*ivec2(tileIndex % atlasColumns, tileIndex / atlasColumns);
+	ivec2 local = ivec2(gl_LocalInvocationID.xy);
+
+	// every invocation sums a strided block of the tile, subtracting the reference on the fly
+	float sum = 0.0;
+	for (int y = local.y; y < tileSize; y += 16)
+	{
+		for (int x = local.x; x < tileSize; x += 16)
+		{
+			float rendered = texelFetch(depthTexture, tileOrigin + ivec2(x, y), 0).r;
+			// the reference is sampled upside down, the same way the subtraction pass does
+			float ref = texelFetch(refTexture, ivec2(x, tileSize - 1 - y), 0).r;
+			sum += abs(ref - rendered);
+		}
+	}
+
+	// shared memory tree reduction
+	uint index = gl_LocalInvocationIndex;
+	partialSums[index] = sum;
+	barrier();
+	for (uint stride = 128u; stride > 0u; stride >>= 1)
+	{
+		if (index < stride)
+		{
+			partialSums[index] += partialSums[index + stride];
+		}
+		barrier();
+	}
+
+	// same average the reduction chain produces
+	if (index == 0u)
+	{
+		energies[firstParticle + tileIndex] = partialSums[0] / float(tileSize*tileSize);
+	}
+}
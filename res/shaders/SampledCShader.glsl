@@ -0,0 +1,65 @@
+#version 460 core
+
+// One work group per particle tile
+layout(local_size_x = 256) in;
+
+uniform sampler2D depthTexture;
+uniform sampler2D refTexture;
+uniform int tileSize;
+uniform int atlasColumns;
+uniform int firstParticle;
+uniform int numSamples;
+
+layout(std430, binding = 0) buffer EnergyBuffer
+{
+	float energies[];
+};
+
+// tile pixel packed as x | y << 16, and the weight that scales it to the mean over the tile
+struct Sample
+{
+	int pixel;
+	float weight;
+};
+
+layout(std430, binding = 1) readonly buffer SampleBuffer
+{
+	Sample samples[];
+};
+
+shared float partialSums[256];
+
+void main()
+{
+	int tileIndex = int(gl_WorkGroupID.x);
+	ivec2 tileOrigin = tileSize*ivec2(tileIndex % atlasColumns, tileIndex / atlasColumns);
+
+	// every invocation scores a strided share of the samples
+	uint index = gl_LocalInvocationIndex;
+	float sum = 0.0;
+	for (int s = int(index); s < numSamples; s += 256)
+	{
+		ivec2 pixel = ivec2(samples[s].pixel & 0xFFFF, samples[s].pixel >> 16);
+		float rendered = texelFetch(depthTexture, tileOrigin + pixel, 0).r;
+		// the reference is sampled upside down, the same way the subtraction pass does
+		float ref = texelFetch(refTexture, ivec2(pixel.x, tileSize - 1 - pixel.y), 0).r;
+		sum += samples[s].weight*abs(ref - rendered);
+	}
+
+	// shared memory tree reduction
+	partialSums[index] = sum;
+	barrier();
+	for (uint stride = 128u; stride > 0u; stride >>= 1)
+	{
+		if (index < stride)
+		{
+			partialSums[index] += partialSums[index + stride];
+		}
+		barrier();
+	}
+
+	if (index == 0u)
+	{
+		energies[firstParticle + tileIndex] = partialSums[0];
+	}
+}
@@ -6,11 +6,15 @@ in vec2 TexCoords;
 
 uniform sampler2D screenTexture;
 uniform sampler2D gendepTexture;
+uniform int atlasColumns;
+uniform int atlasRows;
 
 void main()
 {
 	//FragColor = texture(screenTexture, TexCoords);
-	vec4 ref = texture(screenTexture, TexCoords);
+	// the single reference tile wraps across every tile of the atlas and is read upside down
+	vec2 tiles = vec2(float(atlasColumns), float(atlasRows));
+	vec4 ref = texture(screenTexture, vec2(TexCoords.x, 1.0 - TexCoords.y) * tiles);
 	vec4 rend = texture(gendepTexture, TexCoords);
 	if (ref.z > rend.z)
 	{
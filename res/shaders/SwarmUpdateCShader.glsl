@@ -0,0 +1,200 @@
+#version 460 core
+
+// The whole swarm is updated by a single work group, the particles are strided over its invocations
+layout(local_size_x = 256) in;
+
+struct Particle
+{
+	float position[9];
+	float velocity[9];
+	float bestPosition[9];
+	float bestEnergy;
+};
+
+// Energies of the last render, 16.16 fixed point sums for the fused energy, float averages otherwise
+layout(std430, binding = 0) buffer EnergyBuffer
+{
+	int energies[];
+};
+
+layout(std430, binding = 1) buffer ParticleBuffer
+{
+	Particle particles[];
+};
+
+layout(std430, binding = 2) buffer GlobalBestBuffer
+{
+	float globalBestEnergy;
+	int globalBestIndex;
+	float globalBestPosition[9];
+};
+
+// the instance matrices the next render reads
+layout(std430, binding = 3) writeonly buffer MovementBuffer
+{
+	mat4 movements[];
+};
+
+layout(std430, binding = 4) writeonly buffer ToeRotationBuffer
+{
+	mat4 toeRotations[];
+};
+
+layout(std430, binding = 5) writeonly buffer LegRotationBuffer
+{
+	mat4 legRotations[];
+};
+
+uniform int numParticles;
+uniform float cognitiveConst;
+uniform float socialConst;
+uniform float constrictionConst;
+uniform bool fixedPoint;
+uniform float backgroundEnergy;
+uniform uint seed;
+uniform uint generation;
+// only write the matrices of the initial positions
+uniform bool initialize;
+
+shared float candidateEnergies[256];
+shared int candidateIndices[256];
+
+// pcg hash, one independent stream per particle, draw and generation
+float Random(uint particle, uint draw)
+{
+	uint state = seed ^ (particle * 747796405u) ^ (generation * 2891336453u) ^ (draw * 277803737u);
+	state = state * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	word = (word >> 22u) ^ word;
+	return float(word >> 8) / 16777216.0;
+}
+
+float Energy(int p)
+{
+	if (fixedPoint)
+	{
+		return (backgroundEnergy + float(energies[p]) / 65536.0) / (128.0*128.0);
+	}
+	return intBitsToFloat(energies[p]);
+}
+
+mat4 RotateX(float angle)
+{
+	float c = cos(angle);
+	float s = sin(angle);
+	return mat4(1.0, 0.0, 0.0, 0.0,  0.0, c, s, 0.0,  0.0, -s, c, 0.0,  0.0, 0.0, 0.0, 1.0);
+}
+
+mat4 RotateY(float angle)
+{
+	float c = cos(angle);
+	float s = sin(angle);
+	return mat4(c, 0.0, -s, 0.0,  0.0, 1.0, 0.0, 0.0,  s, 0.0, c, 0.0,  0.0, 0.0, 0.0, 1.0);
+}
+
+mat4 RotateZ(float angle)
+{
+	float c = cos(angle);
+	float s = sin(angle);
+	return mat4(c, s, 0.0, 0.0,  -s, c, 0.0, 0.0,  0.0, 0.0, 1.0, 0.0,  0.0, 0.0, 0.0, 1.0);
+}
+
+// same matrices PSO::Run builds with glm::translate and glm::rotate
+void WriteMatrices(int p)
+{
+	float pose[9] = particles[p].position;
+	mat4 model = mat4(1.0);
+	model[3] = vec4(pose[0], pose[1], pose[2], 1.0);
+	movements[p] = model*RotateX(pose[3])*RotateY(pose[4])*RotateZ(pose[5]);
+	toeRotations[p] = RotateX(pose[6]);
+	legRotations[p] = RotateX(pose[7])*RotateZ(pose[8]);
+}
+
+void main()
+{
+	int index = int(gl_LocalInvocationIndex);
+
+	if (initialize)
+	{
+		for (int p = index; p < numParticles; p += 256)
+		{
+			WriteMatrices(p);
+		}
+		return;
+	}
+
+	// update the personal bests and find the best energy of this generation
+	float candidateEnergy = globalBestEnergy;
+	int candidateIndex = -1;
+	for (int p = index; p < numParticles; p += 256)
+	{
+		float energy = Energy(p);
+		if (energy < particles[p].bestEnergy)
+		{
+			particles[p].bestEnergy = energy;
+			particles[p].bestPosition = particles[p].position;
+		}
+		if (energy < candidateEnergy)
+		{
+			candidateEnergy = energy;
+			candidateIndex = p;
+		}
+	}
+
+	// shared memory argmin, ties go to the lowest particle like the sequential update
+	candidateEnergies[index] = candidateEnergy;
+	candidateIndices[index] = candidateIndex;
+	barrier();
+	for (int stride = 128; stride > 0; stride >>= 1)
+	{
+		if (index < stride)
+		{
+			float otherEnergy = candidateEnergies[index + stride];
+			int otherIndex = candidateIndices[index + stride];
+			if (otherIndex >= 0 && (otherEnergy < candidateEnergies[index] || (otherEnergy == candidateEnergies[index] && otherIndex < candidateIndices[index])))
+			{
+				candidateEnergies[index] = otherEnergy;
+				candidateIndices[index] = otherIndex;
+			}
+		}
+		barrier();
+	}
+
+	if (index == 0 && candidateIndices[0] >= 0)
+	{
+		globalBestEnergy = candidateEnergies[0];
+		globalBestIndex = candidateIndices[0];
+		globalBestPosition = particles[candidateIndices[0]].position;
+	}
+	memoryBarrierBuffer();
+	barrier();
+
+	// constricted velocity update, clamped the same way as Assuage and AssuagePosition
+	const float maxVelocity[6] = float[6](0.01, 0.01, 0.01, 0.05, 0.05, 0.05);
+	const float minPosition[3] = float[3](radians(-15.0), radians(-20.0), radians(-45.0));
+	const float maxPosition[3] = float[3](radians(45.0), radians(45.0), radians(45.0));
+	for (int p = index; p < numParticles; p += 256)
+	{
+		float r1 = Random(uint(p), 0u);
+		float r2 = Random(uint(p), 1u);
+		for (int k = 0; k < 9; k++)
+		{
+			float position = particles[p].position[k];
+			float personal = (particles[p].bestPosition[k] - position)*cognitiveConst*r1;
+			float social = (globalBestPosition[k] - position)*socialConst*r2;
+			float velocity = particles[p].velocity[k] + (personal + social)*constrictionConst;
+			if (k < 6)
+			{
+				velocity = clamp(velocity, -maxVelocity[k], maxVelocity[k]);
+			}
+			position += velocity;
+			if (k >= 6)
+			{
+				position = clamp(position, minPosition[k - 6], maxPosition[k - 6]);
+			}
+			particles[p].velocity[k] = velocity;
+			particles[p].position[k] = position;
+		}
+		WriteMatrices(p);
+	}
+}
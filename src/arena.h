@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for the scratch memory of one tracking session. Allocations are handed out of one block and all
+// released together by Reset. When a round of allocations does not fit, the rest goes to overflow blocks and the next
+// Reset grows the main block to the high water mark, so after the first rounds it never touches the heap again.
+class Arena
+{
+	public:
+		// the main block starts on a cache line, so any alignment up to this holds for offsets within it
+		static const size_t BlockAlignment = 64;
+
+	private:
+		std::unique_ptr<char[]> block;
+		// start of the main block inside the padded allocation
+		char* base;
+		size_t capacity;
+		size_t used;
+		size_t highWater;
+		std::vector<std::unique_ptr<char[]>> overflow;
+
+		// new[] of char is only aligned for fundamental types, so the block is padded and its start rounded up
+		void Grow(size_t bytes)
+		{
+			block.reset(new char[bytes + BlockAlignment]);
+			base = block.get() + (BlockAlignment - reinterpret_cast<std::uintptr_t>(block.get()) % BlockAlignment) % BlockAlignment;
+			capacity = bytes;
+		}
+
+	public:
+		Arena(size_t initialCapacity=0) : base{nullptr}, capacity{0}, used{0}, highWater{0}
+		{
+			if (initialCapacity > 0)
+			{
+				Grow(initialCapacity);
+			}
+		}
+
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		// count default initialized Ts aligned for T, valid until the next Reset
+		template <typename T>
+		T* Allocate(size_t count)
+		{
+			static_assert(std::is_trivially_destructible<T>::value, "Reset never runs destructors");
+			static_assert(alignof(T) <= BlockAlignment, "the main block is only aligned to BlockAlignment");
+			size_t alignment = alignof(T) < 16 ? 16 : alignof(T);
+			size_t bytes = count*sizeof(T);
+			size_t offset = (used + alignment - 1) & ~(alignment - 1);
+			highWater = offset + bytes > highWater ? offset + bytes : highWater;
+			used = offset + bytes;
+			char* memory;
+			if (offset + bytes <= capacity)
+			{
+				memory = base + offset;
+			}
+			else
+			{
+				// padded like the main block
+				overflow.emplace_back(new char[bytes + alignment]);
+				char* start = overflow.back().get();
+				memory = start + (alignment - reinterpret_cast<std::uintptr_t>(start) % alignment) % alignment;
+			}
+			T* items = reinterpret_cast<T*>(memory);
+			for (size_t i = 0; i < count; i++)
+			{
+				new (items + i) T;
+			}
+			return items;
+		}
+
+		// release everything handed out since the last Reset
+		void Reset()
+		{
+			if (!overflow.empty())
+			{
+				overflow.clear();
+				Grow(highWater);
+			}
+			used = 0;
+		}
+
+		size_t Capacity() const
+		{
+			return capacity;
+		}
+};
+
+// Heap allocations made through operator new so far. Defining ARENA_IMPLEMENTATION in one source file replaces the
+// global new and delete with counting versions, the debug checks compare the count before and after a hot loop.
+long long AllocationCount();
+
+#ifdef ARENA_IMPLEMENTATION
+// the deletes are kept out of line, inlined into a caller GCC would flag free on memory that came from new
+#if defined(__GNUC__)
+#define ARENA_NOINLINE __attribute__((noinline))
+#else
+#define ARENA_NOINLINE
+#endif
+
+static std::atomic<long long> allocationCount{0};
+
+long long AllocationCount()
+{
+	return allocationCount.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	void* memory = std::malloc(size ? size : 1);
+	if (!memory)
+	{
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+ARENA_NOINLINE void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+
+ARENA_NOINLINE void operator delete[](void* memory) noexcept
+{
+	std::free(memory);
+}
+
+ARENA_NOINLINE void operator delete(void* memory, std::size_t) noexcept
+{
+	std::free(memory);
+}
+
+ARENA_NOINLINE void operator delete[](void* memory, std::size_t) noexcept
+{
+	std::free(memory);
+}
+#endif
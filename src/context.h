@@ -0,0 +1,216 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#ifdef USE_GLFW
+#include <GLFW/glfw3.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include <iostream>
+
+// Owns the OpenGL 4.6 context everything renders in. Rendering only ever targets framebuffers, so by default
+// the context is a surfaceless EGL one that needs no display server. Building with USE_GLFW falls back to a
+// hidden GLFW window instead.
+class RenderContext
+{
+	public:
+		RenderContext() :
+#ifdef USE_GLFW
+			window{nullptr}
+#else
+			display{EGL_NO_DISPLAY},
+			context{EGL_NO_CONTEXT}
+#endif
+		{}
+
+		RenderContext(const RenderContext&) = delete;
+		RenderContext& operator=(const RenderContext&) = delete;
+
+		~RenderContext()
+		{
+			Destroy();
+		}
+
+		// Create the context, make it current and load the GL entry points through GLEW
+		bool Create(int width, int height, const char* title)
+		{
+			if (!CreateContext(width, height, title))
+			{
+				return false;
+			}
+
+			glewExperimental = true;
+			GLenum glewStatus = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+			// a GLX build of GLEW still loads the core entry points before it fails to find an X display
+			if (glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)
+			{
+				glewStatus = GLEW_OK;
+			}
+#endif
+			if (glewStatus != GLEW_OK)
+			{
+				std::cerr << "WARNING: GLEW not initialized properly" << std::endl;
+				return false;
+			}
+			return true;
+		}
+
+		void MakeCurrent()
+		{
+#ifdef USE_GLFW
+			glfwMakeContextCurrent(window);
+#else
+			eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+#endif
+		}
+
+		// The display connection is shared by every context in the process, so only the context is released
+		void Destroy()
+		{
+#ifdef USE_GLFW
+			if (window)
+			{
+				glfwDestroyWindow(window);
+				window = nullptr;
+			}
+#else
+			if (context != EGL_NO_CONTEXT)
+			{
+				eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+				eglDestroyContext(display, context);
+				context = EGL_NO_CONTEXT;
+			}
+#endif
+		}
+
+	private:
+#ifdef USE_GLFW
+		GLFWwindow* window;
+
+		bool CreateContext(int width, int height, const char* title)
+		{
+			if (!glfwInit())
+			{
+				std::cerr << "WARNING: GLFW not initialized properly" << std::endl;
+				return false;
+			}
+
+			// the window only has to carry the context, so it is never shown
+			glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+			glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+			glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+			glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+			window = glfwCreateWindow(width, height, title, NULL, NULL);
+			if (!window)
+			{
+				std::cerr << "WARNING: GLFW window was not created properly" << std::endl;
+				return false;
+			}
+			glfwMakeContextCurrent(window);
+			return true;
+		}
+#else
+		EGLDisplay display;
+		EGLContext context;
+
+		bool CreateContext(int, int, const char*)
+		{
+			display = OpenDisplay();
+			if (display == EGL_NO_DISPLAY)
+			{
+				std::cerr << "WARNING: no EGL display could be initialized" << std::endl;
+				return false;
+			}
+
+			// nothing is ever presented, pick any config that can render desktop OpenGL
+			EGLint configAttribs[] = {
+				EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+				EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+				EGL_NONE
+			};
+			EGLConfig config;
+			EGLint numConfigs = 0;
+			if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+			{
+				// the surfaceless platform may not expose pbuffer configs
+				configAttribs[1] = EGL_DONT_CARE;
+				if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+				{
+					std::cerr << "WARNING: no EGL config supports OpenGL" << std::endl;
+					return false;
+				}
+			}
+
+			if (!eglBindAPI(EGL_OPENGL_API))
+			{
+				std::cerr << "WARNING: EGL does not support the OpenGL API" << std::endl;
+				return false;
+			}
+
+			EGLint contextAttribs[] = {
+				EGL_CONTEXT_MAJOR_VERSION, 4,
+				EGL_CONTEXT_MINOR_VERSION, 6,
+				EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+				EGL_NONE
+			};
+			context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+			if (context == EGL_NO_CONTEXT)
+			{
+				std::cerr << "WARNING: EGL context was not created properly" << std::endl;
+				return false;
+			}
+
+			// surfaceless, every pass renders into its own framebuffer object
+			if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+			{
+				std::cerr << "WARNING: EGL context could not be made current" << std::endl;
+				return false;
+			}
+			return true;
+		}
+
+		// GPU devices first, then Mesa's surfaceless platform (llvmpipe on servers), then the default display
+		static EGLDisplay OpenDisplay()
+		{
+			PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+			PFNEGLQUERYDEVICESEXTPROC queryDevices = (PFNEGLQUERYDEVICESEXTPROC) eglGetProcAddress("eglQueryDevicesEXT");
+
+			if (getPlatformDisplay && queryDevices)
+			{
+				EGLDeviceEXT devices[8];
+				EGLint numDevices = 0;
+				if (queryDevices(8, devices, &numDevices))
+				{
+					for (int i = 0; i < numDevices; i++)
+					{
+						EGLDisplay deviceDisplay = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, devices[i], nullptr);
+						if (deviceDisplay != EGL_NO_DISPLAY && eglInitialize(deviceDisplay, nullptr, nullptr))
+						{
+							return deviceDisplay;
+						}
+					}
+				}
+			}
+
+			if (getPlatformDisplay)
+			{
+				EGLDisplay surfacelessDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+				if (surfacelessDisplay != EGL_NO_DISPLAY && eglInitialize(surfacelessDisplay, nullptr, nullptr))
+				{
+					return surfacelessDisplay;
+				}
+			}
+
+			EGLDisplay defaultDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+			if (defaultDisplay != EGL_NO_DISPLAY && eglInitialize(defaultDisplay, nullptr, nullptr))
+			{
+				return defaultDisplay;
+			}
+			return EGL_NO_DISPLAY;
+		}
+#endif
+};
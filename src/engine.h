@@ -0,0 +1,126 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <iostream>
+#include <map>
+#include <string>
+
+#include "context.h"
+#include "SkeletonModel.h"
+#include "shader_c.h"
+
+// Long lived owner of the OpenGL context and everything that is expensive to create in it: the compiled programs,
+// the foot model with its VAO and the depth map render target. Map generation and the PSO borrow from one engine.
+class Engine
+{
+	private:
+		// declared first so the context outlives everything created in it
+		RenderContext context;
+		std::map<std::string, GLuint> programs;
+		GLuint mapFramebuffer, mapDepthBuffer;
+		bool hasContext;
+
+	public:
+		SkeletonModel footSkeleton;
+		glm::mat4 MeshToBoneToe, MeshToBoneLeg, BoneToMeshToe, BoneToMeshLeg;
+
+		// without useGL no context is created and the model stays on the CPU, for the software energy on nodes without OpenGL
+		Engine(const char* modelPath="../res/foot_full.dae", bool useGL=true) : mapFramebuffer{0}, mapDepthBuffer{0}, hasContext{useGL}
+		{
+			if (hasContext && !context.Create(128, 128, "Engine"))
+			{
+				std::cerr << "WARNING: OpenGL context was not created properly" << std::endl;
+			}
+
+			// Load the skeleton and associated bone matrices
+			footSkeleton = SkeletonModel(modelPath, hasContext);
+			MeshToBoneLeg = footSkeleton.meshes[0].offsetMatricies[0];
+			MeshToBoneToe = footSkeleton.meshes[0].offsetMatricies[2];
+			BoneToMeshLeg = glm::inverse(MeshToBoneLeg);
+			BoneToMeshToe = glm::inverse(MeshToBoneToe);
+		}
+
+		Engine(const Engine&) = delete;
+		Engine& operator=(const Engine&) = delete;
+
+		~Engine()
+		{
+			if (!hasContext)
+			{
+				return;
+			}
+			context.MakeCurrent();
+			for (auto& program : programs)
+			{
+				glDeleteProgram(program.second);
+			}
+			glDeleteFramebuffers(1, &mapFramebuffer);
+			glDeleteRenderbuffers(1, &mapDepthBuffer);
+			footSkeleton.Release();
+		}
+
+		bool HasContext() const
+		{
+			return hasContext;
+		}
+
+		// compiled once per combination of stages, later calls return the cached program
+		Shader GetShader(const char* vertexPath, const char* fragmentPath, const char* geometryPath=nullptr)
+		{
+			std::string key = std::string(vertexPath) + "|" + fragmentPath + "|" + (geometryPath ? geometryPath : "");
+			Shader shader;
+			auto cached = programs.find(key);
+			if (cached != programs.end())
+			{
+				shader.ID = cached->second;
+				return shader;
+			}
+			shader = Shader(vertexPath, fragmentPath, geometryPath);
+			programs[key] = shader.ID;
+			return shader;
+		}
+
+		ComputeShader GetComputeShader(const char* computePath)
+		{
+			std::string key = computePath;
+			ComputeShader shader;
+			auto cached = programs.find(key);
+			if (cached != programs.end())
+			{
+				shader.ID = cached->second;
+				return shader;
+			}
+			shader = ComputeShader(computePath);
+			programs[key] = shader.ID;
+			return shader;
+		}
+
+		// 128x128 depth only framebuffer the maps are rendered into, created on first use
+		GLuint MapFramebuffer()
+		{
+			if (mapFramebuffer)
+			{
+				return mapFramebuffer;
+			}
+
+			glGenFramebuffers(1, &mapFramebuffer);
+			glBindFramebuffer(GL_FRAMEBUFFER, mapFramebuffer);
+
+			glGenRenderbuffers(1, &mapDepthBuffer);
+			glBindRenderbuffer(GL_RENDERBUFFER, mapDepthBuffer);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, 128, 128);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, mapDepthBuffer);
+			glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+			// No color buffer is drawn to
+			glDrawBuffer(GL_NONE);
+
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			{
+				std::cerr << "WARNING: map framebuffer setup was not successful" << std::endl;
+			}
+			return mapFramebuffer;
+		}
+};
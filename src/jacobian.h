@@ -0,0 +1,166 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cmath>
+#include <vector>
+
+#include "pose.h"
+#include "SkeletonMesh.h"
+
+// Exact derivatives of the rendered linear depth with respect to the 9 pose parameters, from one render of the
+// triangle ID target. Every covered pixel knows its triangle and the barycentrics of the surface point behind it.
+// Moving that point by dX moves the depth seen through the fixed pixel by n.dX / n.dir, with n the triangle normal
+// and dir the pixel ray, and dX follows from the skinning of RTTVShader.glsl with the bone weights and offset
+// matrices of the mesh. Pixels where the silhouette itself moves are not differentiable this way and get 0.
+class PoseJacobian
+{
+	public:
+		static const int NumDOF = 9;
+
+	private:
+		std::vector<glm::vec4> positions;
+		std::vector<glm::vec4> boneWeights;
+		std::vector<unsigned int> indices;
+		glm::mat4 MeshToBoneToe, MeshToBoneLeg, BoneToMeshToe, BoneToMeshLeg;
+		float TanHalfFov;
+		// eye space vertices of the current pose and their derivatives, NumDOF per vertex
+		std::vector<glm::vec3> eyeVertices;
+		std::vector<glm::vec3> derivatives;
+
+		// derivative of a rotation about a unit axis is the cross product matrix of the axis times the rotation
+		static glm::mat4 Generator(const glm::vec3& axis)
+		{
+			glm::mat4 k(0.0f);
+			k[1][0] = -axis.z;
+			k[2][0] = axis.y;
+			k[0][1] = axis.z;
+			k[2][1] = -axis.x;
+			k[0][2] = -axis.y;
+			k[1][2] = axis.x;
+			return k;
+		}
+
+		static glm::mat4 Rotation(float angle, const glm::vec3& axis)
+		{
+			return glm::rotate(glm::mat4(1.0f), angle, axis);
+		}
+
+		// eye space vertices and their derivatives, the same skinning as SoftwareRasterizer::Render
+		void SetPose(const PoseParameters& pose)
+		{
+			const glm::vec3 xAxis(1, 0, 0), yAxis(0, 1, 0), zAxis(0, 0, 1);
+			glm::mat4 model, toeRotation, legRotation;
+			ComputePoseMatrices(pose, model, toeRotation, legRotation);
+			glm::mat4 toe = BoneToMeshToe*toeRotation*MeshToBoneToe;
+			glm::mat4 leg = BoneToMeshLeg*legRotation*MeshToBoneLeg;
+
+			// model is T*Rx*Ry*Rz, the derivatives only act on directions so the translation drops out
+			glm::mat4 rx = Rotation(pose.XRotation, xAxis);
+			glm::mat4 ry = Rotation(pose.YRotation, yAxis);
+			glm::mat4 rz = Rotation(pose.ZRotation, zAxis);
+			glm::mat4 dModel[3] = {Generator(xAxis)*rx*ry*rz, rx*Generator(yAxis)*ry*rz, rx*ry*Generator(zAxis)*rz};
+			// the toe rotation is Rx, the leg Rx*Rz
+			glm::mat4 legX = Rotation(pose.LegXRot, xAxis);
+			glm::mat4 legZ = Rotation(pose.LegZRot, zAxis);
+			glm::mat4 dToe = BoneToMeshToe*Generator(xAxis)*toeRotation*MeshToBoneToe;
+			glm::mat4 dLegX = BoneToMeshLeg*Generator(xAxis)*legX*legZ*MeshToBoneLeg;
+			glm::mat4 dLegZ = BoneToMeshLeg*legX*Generator(zAxis)*legZ*MeshToBoneLeg;
+
+			for (size_t v = 0; v < positions.size(); v++)
+			{
+				const glm::vec4& p = positions[v];
+				const glm::vec4& weights = boneWeights[v];
+				glm::vec4 skinned = weights.z*(toe*p) + weights.x*(leg*p) + (weights.y + weights.w)*p;
+				eyeVertices[v] = glm::vec3(model*skinned);
+				glm::vec3* d = &derivatives[v*NumDOF];
+				d[0] = glm::vec3(1.0f, 0.0f, 0.0f);
+				d[1] = glm::vec3(0.0f, 1.0f, 0.0f);
+				d[2] = glm::vec3(0.0f, 0.0f, 1.0f);
+				for (int a = 0; a < 3; a++)
+				{
+					d[3 + a] = glm::vec3(dModel[a]*skinned);
+				}
+				d[6] = glm::vec3(model*(weights.z*(dToe*p)));
+				d[7] = glm::vec3(model*(weights.x*(dLegX*p)));
+				d[8] = glm::vec3(model*(weights.x*(dLegZ*p)));
+			}
+		}
+
+	public:
+		PoseJacobian(const SkeletonMesh& mesh, float fovDegrees=42.0f)
+		{
+			positions.reserve(mesh.vertices.size());
+			for (const Vertex& vertex : mesh.vertices)
+			{
+				positions.push_back(glm::vec4(vertex.Position, 1.0f));
+			}
+			boneWeights.reserve(mesh.vbd.size());
+			for (const VertexBoneData& weights : mesh.vbd)
+			{
+				boneWeights.push_back(weights.weights);
+			}
+			indices = mesh.indices;
+			MeshToBoneLeg = mesh.offsetMatricies[0];
+			MeshToBoneToe = mesh.offsetMatricies[2];
+			BoneToMeshLeg = glm::inverse(MeshToBoneLeg);
+			BoneToMeshToe = glm::inverse(MeshToBoneToe);
+			TanHalfFov = std::tan(glm::radians(fovDegrees)*0.5f);
+			eyeVertices.resize(positions.size());
+			derivatives.resize(positions.size()*NumDOF);
+		}
+
+		// From a 128x128 triangle ID image of pose, 4 floats a pixel as RTTIDFShader.glsl writes them, fill tiles with the
+		// depth tile followed by one derivative tile per pose parameter, rows from the bottom like the depth maps
+		void Compute(const PoseParameters& pose, const float* idImage, float* tiles)
+		{
+			SetPose(pose);
+			const int tilePixels = 128*128;
+			for (int y = 0; y < 128; y++)
+			{
+				for (int x = 0; x < 128; x++)
+				{
+					int i = y*128 + x;
+					const float* texel = idImage + 4*i;
+					tiles[i] = texel[3];
+					int triangle = (int) texel[0];
+					float facing = 0.0f;
+					glm::vec3 normal(0.0f);
+					unsigned int corners[3] = {0, 0, 0};
+					if (triangle >= 0 && 3*triangle + 2 < (int) indices.size())
+					{
+						for (int k = 0; k < 3; k++)
+						{
+							corners[k] = indices[3*triangle + k];
+						}
+						const glm::vec3& a = eyeVertices[corners[0]];
+						normal = glm::cross(eyeVertices[corners[1]] - a, eyeVertices[corners[2]] - a);
+						glm::vec3 dir(((x + 0.5f) / 64.0f - 1.0f)*TanHalfFov, ((y + 0.5f) / 64.0f - 1.0f)*TanHalfFov, -1.0f);
+						facing = glm::dot(normal, dir);
+					}
+					// background and triangles seen edge on do not move the depth in a differentiable way
+					if (std::abs(facing) <= 1e-6f*glm::length(normal) || facing == 0.0f)
+					{
+						for (int d = 0; d < NumDOF; d++)
+						{
+							tiles[(1 + d)*tilePixels + i] = 0.0f;
+						}
+						continue;
+					}
+					float b1 = texel[1];
+					float b2 = texel[2];
+					float b0 = 1.0f - b1 - b2;
+					const glm::vec3* d0 = &derivatives[corners[0]*NumDOF];
+					const glm::vec3* d1 = &derivatives[corners[1]*NumDOF];
+					const glm::vec3* d2 = &derivatives[corners[2]*NumDOF];
+					float inverse = 1.0f / facing;
+					for (int d = 0; d < NumDOF; d++)
+					{
+						glm::vec3 dX = b0*d0[d] + b1*d1[d] + b2*d2[d];
+						tiles[(1 + d)*tilePixels + i] = glm::dot(normal, dX)*inverse;
+					}
+				}
+			}
+		}
+};
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "pose.h"
+
+// Levenberg-Marquardt refinement of one pose against the per pixel depth residuals rendered - reference. Every
+// iteration renders one batch of 1 + 2*9 poses, the pose being evaluated and its central difference perturbations
+// along each degree of freedom, which gives both its residuals and the Jacobian, or with IterateAnalytic one render
+// and the exact derivatives of PoseJacobian. The damped Gauss-Newton step is then taken from the best pose so far, a
+// step that does not lower the squared residuals raises the damping instead.
+class LMRefiner
+{
+	public:
+		static const int NumDOF = 9;
+		static const int BatchSize = 1 + 2*NumDOF;
+		static const int TilePixels = 128*128;
+
+		// central difference step of every degree of freedom, in PoseParameters member order
+		float Steps[NumDOF];
+
+	private:
+		float InitialLambda;
+		float Lambda;
+		// depth tiles of the last rendered batch, center first, then the + and - perturbation of each degree of freedom,
+		// or with an analytic Jacobian the center and one derivative tile per degree of freedom
+		std::vector<float> Depths;
+		bool Analytic;
+		const float* RefImg;
+		PoseParameters Current, Candidate;
+		bool HaveCurrent;
+		// at Current: sum of squared and of absolute residuals, and the normal equations of the linearized residuals
+		double Cost, AbsoluteSum;
+		// sum of absolute residuals at the pose Start was given
+		double StartAbsoluteSum;
+		double JtJ[NumDOF][NumDOF];
+		double Jtr[NumDOF];
+
+		static void ToArray(const PoseParameters& pose, float* values)
+		{
+			values[0] = pose.XTranslation;
+			values[1] = pose.YTranslation;
+			values[2] = pose.ZTranslation;
+			values[3] = pose.XRotation;
+			values[4] = pose.YRotation;
+			values[5] = pose.ZRotation;
+			values[6] = pose.ToeXRot;
+			values[7] = pose.LegXRot;
+			values[8] = pose.LegZRot;
+		}
+
+		static PoseParameters FromArray(const float* values)
+		{
+			return PoseParameters(values[0], values[1], values[2], values[3], values[4], values[5], values[6], values[7], values[8]);
+		}
+
+		// residuals of the center tile, and with accumulate the normal equations from the perturbed tiles
+		void Evaluate(double& cost, double& absoluteSum, bool accumulate)
+		{
+			cost = 0.0;
+			absoluteSum = 0.0;
+			if (accumulate)
+			{
+				for (int a = 0; a < NumDOF; a++)
+				{
+					Jtr[a] = 0.0;
+					for (int b = 0; b < NumDOF; b++)
+					{
+						JtJ[a][b] = 0.0;
+					}
+				}
+			}
+			const float* center = Depths.data();
+			float inverseSteps[NumDOF];
+			for (int d = 0; d < NumDOF; d++)
+			{
+				inverseSteps[d] = 0.5f / Steps[d];
+			}
+			for (int y = 0; y < 128; y++)
+			{
+				// the reference is sampled upside down, the same way the subtraction pass does
+				const float* refRow = RefImg + (127 - y)*128;
+				for (int x = 0; x < 128; x++)
+				{
+					int i = y*128 + x;
+					double r = center[i] - refRow[x];
+					cost += r*r;
+					absoluteSum += std::abs(r);
+					// the exact derivatives only see the surface move in depth, not the silhouette, so a pixel where only one
+					// of the two images has the foot would pull the surface toward the background
+					if (!accumulate || (Analytic && (center[i] >= 1.0f || refRow[x] >= 1.0f)))
+					{
+						continue;
+					}
+					double j[NumDOF];
+					bool any = false;
+					for (int d = 0; d < NumDOF; d++)
+					{
+						if (Analytic)
+						{
+							j[d] = Depths[(1 + d)*TilePixels + i];
+						}
+						else
+						{
+							float plus = Depths[(1 + 2*d)*TilePixels + i];
+							float minus = Depths[(2 + 2*d)*TilePixels + i];
+							j[d] = (plus - minus)*inverseSteps[d];
+						}
+						any = any || j[d] != 0.0;
+					}
+					// most of the tile is background in every perturbation
+					if (!any)
+					{
+						continue;
+					}
+					for (int a = 0; a < NumDOF; a++)
+					{
+						Jtr[a] += j[a]*r;
+						for (int b = a; b < NumDOF; b++)
+						{
+							JtJ[a][b] += j[a]*j[b];
+						}
+					}
+				}
+			}
+			if (accumulate)
+			{
+				for (int a = 0; a < NumDOF; a++)
+				{
+					for (int b = 0; b < a; b++)
+					{
+						JtJ[a][b] = JtJ[b][a];
+					}
+				}
+			}
+		}
+
+		// solve (JtJ + Lambda*diag(JtJ))*step = -Jtr by Gaussian elimination with partial pivoting, degrees of freedom
+		// that change no pixel get no step
+		void SolveStep(double* step) const
+		{
+			double A[NumDOF][NumDOF + 1];
+			for (int a = 0; a < NumDOF; a++)
+			{
+				for (int b = 0; b < NumDOF; b++)
+				{
+					A[a][b] = JtJ[a][b];
+				}
+				A[a][a] = JtJ[a][a] > 0.0 ? JtJ[a][a]*(1.0 + Lambda) : 1.0;
+				A[a][NumDOF] = -Jtr[a];
+			}
+			for (int c = 0; c < NumDOF; c++)
+			{
+				int pivot = c;
+				for (int r = c + 1; r < NumDOF; r++)
+				{
+					if (std::abs(A[r][c]) > std::abs(A[pivot][c]))
+					{
+						pivot = r;
+					}
+				}
+				for (int k = 0; k <= NumDOF; k++)
+				{
+					std::swap(A[c][k], A[pivot][k]);
+				}
+				if (A[c][c] == 0.0)
+				{
+					continue;
+				}
+				for (int r = c + 1; r < NumDOF; r++)
+				{
+					double factor = A[r][c] / A[c][c];
+					for (int k = c; k <= NumDOF; k++)
+					{
+						A[r][k] -= factor*A[c][k];
+					}
+				}
+			}
+			for (int c = NumDOF - 1; c >= 0; c--)
+			{
+				double sum = A[c][NumDOF];
+				for (int k = c + 1; k < NumDOF; k++)
+				{
+					sum -= A[c][k]*step[k];
+				}
+				step[c] = A[c][c] == 0.0 ? 0.0 : sum / A[c][c];
+			}
+		}
+
+		// next pose to try from Current, false when the step has become too small to matter
+		bool ProposeCandidate()
+		{
+			double step[NumDOF];
+			SolveStep(step);
+			float values[NumDOF];
+			ToArray(Current, values);
+			double size = 0.0;
+			for (int d = 0; d < NumDOF; d++)
+			{
+				values[d] += (float) step[d];
+				size += step[d]*step[d];
+			}
+			Candidate = FromArray(values);
+			Candidate.AssuagePosition();
+			return std::sqrt(size) > 1e-6;
+		}
+
+		// take the pose just rendered as the new best if it is, then propose the next one
+		bool Advance()
+		{
+			if (!HaveCurrent)
+			{
+				Evaluate(Cost, AbsoluteSum, true);
+				StartAbsoluteSum = AbsoluteSum;
+				HaveCurrent = true;
+			}
+			else
+			{
+				// the candidate's batch only replaces the linearization when the candidate is better
+				double cost, absoluteSum;
+				Evaluate(cost, absoluteSum, false);
+				if (cost < Cost)
+				{
+					Current = Candidate;
+					Evaluate(Cost, AbsoluteSum, true);
+					Lambda = std::max(Lambda*0.1f, 1e-7f);
+				}
+				else
+				{
+					Lambda *= 10.0f;
+				}
+			}
+			return Lambda < 1e8f && ProposeCandidate();
+		}
+
+	public:
+		LMRefiner(float initialLambda=1e-3f) : InitialLambda{initialLambda}, Lambda{initialLambda}, Analytic{false}, RefImg{nullptr}, HaveCurrent{false}, Cost{0.0}, AbsoluteSum{0.0}, StartAbsoluteSum{0.0}
+		{
+			// a few pixels of motion at the working distance, the angles a little more than the PSO velocity limits
+			const float steps[NumDOF] = {0.002f, 0.002f, 0.002f, 0.01f, 0.01f, 0.01f, 0.02f, 0.02f, 0.02f};
+			for (int d = 0; d < NumDOF; d++)
+			{
+				Steps[d] = steps[d];
+			}
+			Depths.resize(BatchSize*TilePixels);
+		}
+
+		// refine from pose against a 128x128 reference, which must stay valid while iterating
+		void Start(const PoseParameters& pose, const float* refImg)
+		{
+			Current = pose;
+			Candidate = pose;
+			RefImg = refImg;
+			Lambda = InitialLambda;
+			HaveCurrent = false;
+		}
+
+		// The poses of the next batch, center first. render(poses, BatchSize, depths) must write the linear depth tile
+		// of each pose into depths, 128*128 floats apiece with row 0 at the bottom like SoftwareRasterizer::Render.
+		template <typename Render>
+		bool Iterate(Render render)
+		{
+			PoseParameters poses[BatchSize];
+			poses[0] = HaveCurrent ? Candidate : Current;
+			float center[NumDOF];
+			ToArray(poses[0], center);
+			for (int d = 0; d < NumDOF; d++)
+			{
+				float values[NumDOF];
+				std::copy(center, center + NumDOF, values);
+				values[d] = center[d] + Steps[d];
+				poses[1 + 2*d] = FromArray(values);
+				values[d] = center[d] - Steps[d];
+				poses[2 + 2*d] = FromArray(values);
+			}
+			render(poses, BatchSize, Depths.data());
+			Analytic = false;
+			return Advance();
+		}
+
+		// One iteration from a single render. render(pose, tiles) must write the depth tile of the pose followed by the
+		// derivative of the depth with respect to each degree of freedom, NumDOF + 1 tiles, like PoseJacobian::Compute.
+		template <typename Render>
+		bool IterateAnalytic(Render render)
+		{
+			render(HaveCurrent ? Candidate : Current, Depths.data());
+			Analytic = true;
+			return Advance();
+		}
+
+		// best pose so far
+		const PoseParameters& Pose() const
+		{
+			return Current;
+		}
+
+		// mean |ref - rendered| of the best pose so far, the energy the PSO minimizes
+		float Energy() const
+		{
+			return HaveCurrent ? (float) (AbsoluteSum / TilePixels) : std::numeric_limits<float>::infinity();
+		}
+
+		// the same energy of the pose Start was given, once the first iteration has rendered it
+		float StartEnergy() const
+		{
+			return HaveCurrent ? (float) (StartAbsoluteSum / TilePixels) : std::numeric_limits<float>::infinity();
+		}
+};
@@ -1,10 +1,15 @@
 #include <string>
 #include <fstream>
 #include <chrono>
-#include <random>
+#include <cassert>
 #define STB_IMAGE_IMPLEMENTATION
+#define ARENA_IMPLEMENTATION
 
 #include "pso.h"
+#include "random.h"
+#include "sampling.h"
+#include "simd.h"
+#include "tracker.h"
 
 static const float PI = 3.1415926;
 static const int windowWidth = 128;
@@ -12,80 +17,50 @@ static const int windowHeight = 128;
 
 float CalculateEnergy(float* depthImage1, float* depthImage2, int imageSize)
 {
-	float energy = 0.0f;
-	for (int i = 0; i < imageSize; i++)
-	{
-		energy = energy + std::abs(depthImage1[i] - depthImage2[i]);
-	}
-	return energy;
+	return AbsDiffSum(depthImage1, depthImage2, imageSize);
 }
 
-float** GenerateMapsFromPoseParameters(int numParams, PoseParameters* poseparams)
+float** GenerateMapsFromPoseParameters(Engine& engine, int numParams, PoseParameters* poseparams)
 {
-	GLFWwindow* window;
-
-	/* Initialize the library */
-	if (!glfwInit())
-		return NULL;
-
-	/* Create a windowed mode window and its OpenGL context */
-	window = glfwCreateWindow(windowWidth, windowHeight, "OpenGL Testing", NULL, NULL);
-	if (!window)
-	{
-		glfwTerminate();
-		return NULL;
-	}
-
-	// Make the window's context current and then hide it
-	glfwMakeContextCurrent(window);
-	glfwHideWindow(window);
-
-	// Initialize GLEW
-	glewExperimental = true;
-	if (glewInit() != GLEW_OK)
-		return NULL;
-
-	// Get and set up the shaders
-	const char* RTTVertexShaderPath = "../res/shaders/MainTestVertexShader.glsl";
-	const char* RTTFragmentShaderPath = "../res/shaders/MainTestFragmentShader.glsl";
-
-	Shader RTTShader(RTTVertexShaderPath, RTTFragmentShaderPath);
+	// Get the shaders and framebuffer from the engine, they are only created on the first call
+	Shader RTTShader = engine.GetShader("../res/shaders/MainTestVertexShader.glsl", "../res/shaders/MainTestFragmentShader.glsl");
+	glBindFramebuffer(GL_FRAMEBUFFER, engine.MapFramebuffer());
+	glViewport(0, 0, windowWidth, windowHeight);
 
 	// Enable depth testing
 	glEnable(GL_DEPTH_TEST);
-
-	// The framebuffer, which regroups 0, 1, or more textures, and 0 or 1 depth buffer
-	GLuint FramebufferName = 0;
-	glGenFramebuffers(1, &FramebufferName);
-	glBindFramebuffer(GL_FRAMEBUFFER, FramebufferName);
-
-	// The depth buffer
-	GLuint depthrenderbuffer;
-	glGenRenderbuffers(1, &depthrenderbuffer);
-	glBindRenderbuffer(GL_RENDERBUFFER, depthrenderbuffer);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, windowWidth, windowHeight);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthrenderbuffer);
-	glBindRenderbuffer(GL_RENDERBUFFER, 0);
-
-	// No color buffer is drawn to
-	glDrawBuffer(GL_NONE);
-
-	// check if the framebuffer is OK
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-	{
-		std::cerr << "framebuffer setup was not successful" << std::endl;
-		return NULL;
-	}
+	glDepthFunc(GL_LESS);
 
 	// Save image into array
 	float** depthImages = new float*[numParams];
 
-	// Load model
-	SkeletonModel footModel("../res/foot_full.dae");
+	SkeletonModel& footModel = engine.footSkeleton;
 
 	float zNear = 0.1f;
 	float zFar = 1.0f;
 
+	// matrices of every pose up front, through the same batch kernel as the PSO instance buffers
+	std::vector<float> dofs[9];
+	for (int d = 0; d < 9; d++)
+	{
+		dofs[d].resize(numParams);
+	}
+	for (int i = 0; i < numParams; i++)
+	{
+		const float values[9] = {poseparams[i].XTranslation, poseparams[i].YTranslation, poseparams[i].ZTranslation, poseparams[i].XRotation, poseparams[i].YRotation, poseparams[i].ZRotation, poseparams[i].ToeXRot, poseparams[i].LegXRot, poseparams[i].LegZRot};
+		for (int d = 0; d < 9; d++)
+		{
+			dofs[d][i] = values[d];
+		}
+	}
+	const float* dofPointers[9];
+	for (int d = 0; d < 9; d++)
+	{
+		dofPointers[d] = dofs[d].data();
+	}
+	std::vector<glm::mat4> models(numParams), toeRotations(numParams), legRotations(numParams);
+	ComputePoseMatricesBatch(dofPointers, numParams, models.data(), toeRotations.data(), legRotations.data());
+
 	for (int i = 0; i < numParams; i++) {
 		// allocate space for depth image
 		float* depthImageFromRenderbuffer = new float[windowWidth*windowHeight];
@@ -94,20 +69,13 @@ float** GenerateMapsFromPoseParameters(int numParams, PoseParameters* poseparams
 		glClear(GL_DEPTH_BUFFER_BIT);
 
 		// Set up MVP matricies
-		PoseParameters params = poseparams[i];
-		glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(params.XTranslation, params.YTranslation, params.ZTranslation));
-		model = glm::rotate(glm::rotate(glm::rotate(model, params.XRotation, glm::vec3(1, 0, 0)), params.YRotation, glm::vec3(0, 1, 0)), params.ZRotation, glm::vec3(0, 0, 1));
-		model = glm::scale(model, glm::vec3(1.0f));
+		glm::mat4 model = models[i];
+		glm::mat4 localtoerot = toeRotations[i];
+		glm::mat4 locallegrot = legRotations[i];
 		glm::mat4 proj = glm::perspective(glm::radians(42.0f), 1.0f, zNear, zFar);
 		
-		glm::mat4 localtoerot = glm::rotate(glm::rotate(glm::rotate(glm::mat4(1.0f), params.ToeXRot, glm::vec3(1, 0, 0)), 0.0f, glm::vec3(0, 1, 0)), 0.0f, glm::vec3(0, 0, 1));
-		glm::mat4 locallegrot = glm::rotate(glm::rotate(glm::rotate(glm::mat4(1.0f), params.LegXRot, glm::vec3(1, 0, 0)), 0.0f, glm::vec3(0, 1, 0)), params.LegZRot, glm::vec3(0, 0, 1));
-		glm::mat4 MeshToBoneLeg = footModel.meshes[0].offsetMatricies[0];
-		glm::mat4 MeshToBoneToe = footModel.meshes[0].offsetMatricies[2];
-		glm::mat4 BoneToMeshLeg = glm::inverse(MeshToBoneLeg);
-		glm::mat4 BoneToMeshToe = glm::inverse(MeshToBoneToe);
-		glm::mat4 ToeRotation = BoneToMeshToe*localtoerot*MeshToBoneToe;
-		glm::mat4 LegRotation = BoneToMeshLeg*locallegrot*MeshToBoneLeg;
+		glm::mat4 ToeRotation = engine.BoneToMeshToe*localtoerot*engine.MeshToBoneToe;
+		glm::mat4 LegRotation = engine.BoneToMeshLeg*locallegrot*engine.MeshToBoneLeg;
 
 		// Set up shader
 		RTTShader.use();
@@ -120,10 +88,6 @@ float** GenerateMapsFromPoseParameters(int numParams, PoseParameters* poseparams
 		RTTShader.setMat4("leg_rot", LegRotation);
 		footModel.Draw();
 
-		// Render to our framebuffer
-		glBindRenderbuffer(GL_RENDERBUFFER, depthrenderbuffer);
-		glBindFramebuffer(GL_FRAMEBUFFER, depthrenderbuffer);
-
 		// Save image
 		glReadPixels(0, 0, windowWidth, windowHeight, GL_DEPTH_COMPONENT, GL_FLOAT, depthImageFromRenderbuffer);
 		depthImages[i] = depthImageFromRenderbuffer;
@@ -177,38 +141,122 @@ int main()
 	float* refImage = ReadFile("../../Depth-Resources/ref128.txt", windowWidth, windowHeight);
 	float* flippedRefImage = ReadFile("../../Depth-Resources/ref128f.txt", windowWidth, windowHeight);
 	
-	std::random_device rd;
-	std::mt19937 gen(rd());
+	// every random number of a run comes from this seed, stream 0 for the initial poses and 1 for the swarm
+	const uint64_t seed = 1;
+	RandomStream random(seed, 0);
 
 	float tx = 0.0f; float ty = 0.0f; float tz = -0.43f; 
 	float rx = 5*PI/8+0.2; float ry=PI-0.13; float rz=-PI/2+0.03;
 	float st = 0.05; float sr = 0.3;
 
-	std::uniform_real_distribution<float> transx(tx-st,tx+st);
-	std::uniform_real_distribution<float> transy(ty-st,ty+st);
-	std::uniform_real_distribution<float> transz(tz-st,tz+st);
-	std::uniform_real_distribution<float> rotx(rx-sr,rx+sr);
-	std::uniform_real_distribution<float> roty(ry-sr,ry+sr);
-	std::uniform_real_distribution<float> rotz(rz-sr,rz+sr);
-
 	// non gloal parameters
-	std::uniform_real_distribution<float> toerotx(glm::radians(-15.0f), glm::radians(45.0f));
-	std::uniform_real_distribution<float> legrotx(glm::radians(-20.0f), glm::radians(45.0f));
-	std::uniform_real_distribution<float> legrotz(glm::radians(-45.0f), glm::radians(45.0f));
-
+	float toeXMin = glm::radians(-15.0f); float toeXMax = glm::radians(45.0f);
+	float legXMin = glm::radians(-20.0f); float legXMax = glm::radians(45.0f);
+	float legZMin = glm::radians(-45.0f); float legZMax = glm::radians(45.0f);
+
+	// the joints are drawn over their whole range, the box is centered on the middle of it
+	PoseParameters initialPose(tx, ty, tz, rx, ry, rz, 0.5f*(toeXMin + toeXMax), 0.5f*(legXMin + legXMax), 0.5f*(legZMin + legZMax));
+	TrackerSettings tracking;
+	tracking.InitialSpread = PoseParameters(st, st, st, sr, sr, sr, 0.5f*(toeXMax - toeXMin), 0.5f*(legXMax - legXMin), 0.5f*(legZMax - legZMin));
+	// 20 generations for the first frame, a warm frame starts close and gets at most 10 within its deadline
+	tracking.InitialIterations = 20;
+	tracking.TrackingIterations = 10;
 	PoseParameters params[totalParticles];
-	for (int i = 0; i < totalParticles; i++)
+	SeedUniform(initialPose, tracking.InitialSpread, random, params, totalParticles);
+	// one context, set of programs and foot model for the map generation and the optimizer
+	Engine engine;
+	float** images = GenerateMapsFromPoseParameters(engine, totalParticles, params);
+
+	// dense energies of the GL maps, a few images per task on the pool every CPU stage shares
+	float* glEnergies = new float[totalParticles];
+	ThreadPool& pool = ThreadPool::Shared();
+	pool.ParallelForRange(totalParticles, 8, [&](int begin, int end) {
+		BatchEnergies(refImage, images + begin, end - begin, windowWidth*windowHeight, glEnergies + begin);
+	});
+
+	// parity of the software energy with the GL energy it stands in for, both PSOs score the initial poses against the
+	// reference Run gets, with their own shaders and near plane
+	PSO pso(engine, totalParticles);
 	{
-		params[i] = PoseParameters(transx(gen), transy(gen), transz(gen), rotx(gen), roty(gen), rotz(gen), toerotx(gen), legrotx(gen), legrotz(gen));	
+		PSO softwarePSO(engine, totalParticles, 2.8f, 1.3f, EnergyMode::Software);
+		std::vector<float> psoEnergies(totalParticles), softwareEnergies(totalParticles);
+		pso.Score(params, flippedRefImage, psoEnergies.data());
+		softwarePSO.Score(params, flippedRefImage, softwareEnergies.data());
+		float maxParityError = 0.0f;
+		for (int i = 0; i < totalParticles; i++)
+		{
+			maxParityError = std::max(maxParityError, std::abs(psoEnergies[i] - softwareEnergies[i]) / psoEnergies[i]);
+			std::cout << "Pose " << i << ": " << psoEnergies[i]*windowWidth*windowHeight << " software: " << softwareEnergies[i]*windowWidth*windowHeight << std::endl;
+		}
+		std::cout << "Max relative software energy error: " << maxParityError << std::endl;
+		// the rasterizer follows the GL fill rule and depth math, what is left is float rounding
+		assert(maxParityError < 1e-3f);
 	}
-	float** images = GenerateMapsFromPoseParameters(totalParticles, params);
+
+	// the sampled energy of the GL maps against their dense energy, the samples use the reference the PSO gets
+	SampleSet samples = StratifiedSamples(flippedRefImage, 1024);
+	float maxSampledError = 0.0f;
 	for (int i = 0; i < totalParticles; i++)
 	{
-		std::cout << "Image " << i << ": " << CalculateEnergy(refImage, images[i], windowWidth*windowHeight) << std::endl;
+		float sampledEnergy = 0.0f;
+		for (size_t s = 0; s < samples.Pixels.size(); s++)
+		{
+			PixelCoord pixel = samples.Pixels[s];
+			sampledEnergy += samples.Weights[s]*std::abs(flippedRefImage[(127 - pixel.Y)*128 + pixel.X] - images[i][pixel.Y*128 + pixel.X]);
+		}
+		sampledEnergy *= windowWidth*windowHeight;
+		maxSampledError = std::max(maxSampledError, std::abs(glEnergies[i] - sampledEnergy) / glEnergies[i]);
+	}
+	std::cout << "Max relative sampled energy error with " << samples.Pixels.size() << " pixels: " << maxSampledError << std::endl;
+	// the error falls about as 1/sqrt(samples), 28% at 256 and 5% at 4096 on a synthetic silhouette, so 1024 should
+	// stay well inside 20%
+	assert(maxSampledError < 0.2f);
+	delete[] glEnergies;
+
+	pso.SetSeed(seed, 1);
+	// 20 generations at most, fewer once the best stops improving or the swarm has closed in on one pose
+	StoppingCriteria stopping;
+	stopping.Window = 10;
+	stopping.MinImprovement = 0.001f;
+	stopping.MinDiameter = 0.001f;
+	pso.SetStoppingCriteria(stopping);
+	// a few LM steps on the best pose stand in for the last ten generations, one render each with exact Jacobians
+	pso.SetRefinement(5, true);
+	// the tracker's first frame is seeded from the same stream as the maps above, so it starts from the same poses
+	Tracker tracker(pso, initialPose, tracking);
+	tracker.SetSeed(seed, 0);
+	RunResult result = tracker.Track(flippedRefImage);
+	std::cout << "PSO ran " << result.Generations << " generations, stopped by " << StopReasonName(result.Reason) << std::endl;
+	PoseParameters optimizedParams = result.Position;
+	// a second frame of the session gets the time budget of a 30 Hz camera instead of a generation count and resumes
+	// the swarm around the predicted pose, it reuses everything the first one sized, so it must not touch the heap
+	long long allocationsBefore = AllocationCount();
+	auto deadline = std::chrono::high_resolution_clock::now() + std::chrono::milliseconds(33);
+	RunResult timed = tracker.Track(flippedRefImage, deadline);
+	long long warmAllocations = AllocationCount() - allocationsBefore;
+	std::cout << "Warm frame: " << timed.Generations << " generations, stopped by " << StopReasonName(timed.Reason) << ", energy " << timed.Energy*128*128 << " against " << result.Energy*128*128 << std::endl;
+	std::cout << "Deadline run: " << timed.Generations << " generations in " << timed.ElapsedMs << " of " << timed.BudgetMs << " ms, mean generation " << timed.MeanGenerationMs << " ms" << std::endl;
+	std::cout << "Heap allocations in a warm Run: " << warmAllocations << std::endl;
+	assert(warmAllocations == 0);
+	// a deadline that has already passed still runs the first generation and stops at the top of the second, before
+	// the warm allocation check has a snapshot
+	RunResult late = pso.RunUntil(params, flippedRefImage, std::chrono::high_resolution_clock::now(), 5);
+	std::cout << "Expired deadline run: " << late.Generations << " generations, stopped by " << StopReasonName(late.Reason) << std::endl;
+	assert(late.Generations == 1 && late.Reason == StopReason::Deadline);
+
+	// the resident swarm draws its random factors on the GPU from a seed of its stream, so a different seed must move
+	// the swarm differently
+	{
+		PSO residentPSO(engine, totalParticles, 2.8f, 1.3f, EnergyMode::Compute, RenderLayout::Atlas, true);
+		residentPSO.SetSeed(seed, 1);
+		RunResult first = residentPSO.Run(params, flippedRefImage, 10);
+		residentPSO.SetSeed(seed + 1, 1);
+		RunResult second = residentPSO.Run(params, flippedRefImage, 10);
+		PoseParameters delta = first.Position - second.Position;
+		float seedDistance = std::abs(delta.XTranslation) + std::abs(delta.YTranslation) + std::abs(delta.ZTranslation) + std::abs(delta.XRotation) + std::abs(delta.YRotation) + std::abs(delta.ZRotation) + std::abs(delta.ToeXRot) + std::abs(delta.LegXRot) + std::abs(delta.LegZRot);
+		std::cout << "Resident swarm best pose distance between seeds " << seed << " and " << seed + 1 << ": " << seedDistance << std::endl;
+		assert(seedDistance > 0.0f);
 	}
-
-	PSO pso(totalParticles);
-	PoseParameters optimizedParams = pso.Run(params, flippedRefImage, 30);
 	std::cout << optimizedParams.XTranslation << " " << optimizedParams.YTranslation << " " << optimizedParams.ZTranslation << " " << optimizedParams.XRotation << " " << optimizedParams.YRotation << " " << optimizedParams.ZRotation << std::endl;
 	
 	for (int i = 0; i < totalParticles; i++)
@@ -218,7 +266,7 @@ int main()
 		WriteToFile(images[i], 128, 128, outputPath);
 	}
 	PoseParameters oppa[1] = {optimizedParams};
-	float** image = GenerateMapsFromPoseParameters(1, oppa);
+	float** image = GenerateMapsFromPoseParameters(engine, 1, oppa);
 	const char* optimgoutput = "/home/cicada/Cicada/Depth-Resources/opt.txt";
 	WriteToFile(image[0], 128, 128, optimgoutput);
 	std::cout << "Opt: " << CalculateEnergy(refImage, image[0], windowWidth*windowHeight) << std::endl;
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+#include "simd.h"
+
+struct PoseParameters
+{
+	public:
+		float XTranslation;
+		float YTranslation;
+		float ZTranslation;
+		float XRotation;
+		float YRotation;
+		float ZRotation;
+		float ToeXRot;
+		float LegXRot;
+		float LegZRot;
+
+		PoseParameters() : XTranslation{0.0f}, YTranslation{0.0f}, ZTranslation{0.0f}, XRotation{0.0f}, YRotation{0.0f}, ZRotation{0.0f}, ToeXRot{0.0f}, LegXRot{0.0f}, LegZRot{0.0f} {}
+
+		PoseParameters(float xtrans, float ytrans, float ztrans, float xrot, float yrot, float zrot, float toexrot, float legxrot, float legzrot) : XTranslation{xtrans}, YTranslation{ytrans}, ZTranslation{ztrans}, XRotation{xrot}, YRotation{yrot}, ZRotation{zrot}, ToeXRot{toexrot}, LegXRot{legxrot}, LegZRot{legzrot} {}
+
+		PoseParameters(const PoseParameters &params)
+		{
+			XTranslation = params.XTranslation;
+			YTranslation = params.YTranslation;
+			ZTranslation = params.ZTranslation;
+			XRotation = params.XRotation;
+			YRotation = params.YRotation;
+			ZRotation = params.ZRotation;
+			ToeXRot = params.ToeXRot;
+			LegXRot = params.LegXRot;
+			LegZRot = params.LegZRot;
+		}
+
+		PoseParameters operator+(PoseParameters const &obj) const
+		{
+			return PoseParameters(XTranslation + obj.XTranslation, YTranslation + obj.YTranslation, ZTranslation + obj.ZTranslation, XRotation + obj.XRotation, YRotation + obj.YRotation, ZRotation + obj.ZRotation, ToeXRot + obj.ToeXRot, LegXRot + obj.LegXRot, LegZRot + obj.LegZRot);	
+		}
+
+		PoseParameters operator-(PoseParameters const &obj) const
+		{
+			return PoseParameters(XTranslation - obj.XTranslation, YTranslation - obj.YTranslation, ZTranslation - obj.ZTranslation, XRotation - obj.XRotation, YRotation - obj.YRotation, ZRotation - obj.ZRotation, ToeXRot - obj.ToeXRot, LegXRot - obj.LegXRot, LegZRot - obj.LegZRot);	
+		}
+
+		PoseParameters operator*(float c)
+		{
+			return PoseParameters(c * XTranslation, c * YTranslation, c * ZTranslation, c * XRotation, c * YRotation, c * ZRotation, c * ToeXRot, c * LegXRot, c * LegZRot);
+		}
+
+		void Assuage(float xT=0.01, float yT=0.01, float zT=0.01, float xR=0.05, float yR=0.05, float zR=0.05)
+		{
+			XTranslation = XTranslation > xT ? xT : XTranslation < -xT ? -xT : XTranslation;
+			YTranslation = YTranslation > yT ? yT : YTranslation < -yT ? -yT : YTranslation;
+			ZTranslation = ZTranslation > zT ? zT : ZTranslation < -zT ? -zT : ZTranslation;
+			XRotation = XRotation > xR ? xR : XRotation < -xR ? -xR : XRotation;
+			YRotation = YRotation > yR ? yR : YRotation < -yR ? -yR : YRotation;
+			ZRotation = ZRotation > zR ? zR : ZRotation < -zR ? -zR : ZRotation;
+		}
+
+		void AssuagePosition(float toeXMin=glm::radians(-15.0f), float toeXMax=glm::radians(45.0f), float legXMin=glm::radians(-20.0f), float legXMax=glm::radians(45.0f), float legZMin=glm::radians(-45.0f), float legZMax=glm::radians(45.0f))
+		{
+			ToeXRot = ToeXRot < toeXMin ? toeXMin : ToeXRot > toeXMax ? toeXMax : ToeXRot;
+			LegXRot = LegXRot < legXMin ? legXMin : LegXRot > legXMax ? legXMax : LegXRot;
+			LegZRot = LegZRot < legZMin ? legZMin : LegZRot > legZMax ? legZMax : LegZRot;
+		}
+
+		// For debugging only
+		void Print()
+		{
+			std::cout << "XTranslation: " << XTranslation << " YTranslation: " << YTranslation << " ZTranslation: " << ZTranslation << " XRotation: " << XRotation << " YRotation: " << YRotation << " ZRotation: " << ZRotation << " ToeXRot: " << ToeXRot << " LegXRot: " << LegXRot << " LegZRot: " << LegZRot << std::endl;
+		}
+};
+
+class Particle {
+
+	public:
+		PoseParameters Position;
+		float BestEnergyScore;
+		PoseParameters BestPosition;
+		PoseParameters Velocity;
+
+		Particle(): Position{PoseParameters()}, BestEnergyScore{std::numeric_limits<float>::infinity()}, BestPosition{PoseParameters()}, Velocity{PoseParameters()} {}
+
+};
+
+// Model, toe and leg matrices of a pose, the per instance matrices RTTVShader.glsl skins the foot with
+inline void ComputePoseMatrices(const PoseParameters& pose, glm::mat4& model, glm::mat4& toeRotation, glm::mat4& legRotation)
+{
+	model = glm::translate(glm::mat4(1.0f), glm::vec3(pose.XTranslation, pose.YTranslation, pose.ZTranslation));
+	model = glm::rotate(glm::rotate(glm::rotate(model, pose.XRotation, glm::vec3(1, 0, 0)), pose.YRotation, glm::vec3(0, 1, 0)), pose.ZRotation, glm::vec3(0, 0, 1));
+	toeRotation = glm::rotate(glm::rotate(glm::rotate(glm::mat4(1.0f), pose.ToeXRot, glm::vec3(1, 0, 0)), 0.0f, glm::vec3(0, 1, 0)), 0.0f, glm::vec3(0, 0, 1));
+	legRotation = glm::rotate(glm::rotate(glm::rotate(glm::mat4(1.0f), pose.LegXRot, glm::vec3(1, 0, 0)), 0.0f, glm::vec3(0, 1, 0)), pose.LegZRot, glm::vec3(0, 0, 1));
+}
+
+// Matrices of one pose from the sines and cosines of XRotation, YRotation, ZRotation, ToeXRot, LegXRot and LegZRot,
+// written out in closed form: model is T*Rx*Ry*Rz, the toe Rx and the leg Rx*Rz, as ComputePoseMatrices builds them
+inline void AssemblePoseMatrices(float tx, float ty, float tz, const float* s, const float* c, glm::mat4& model, glm::mat4& toeRotation, glm::mat4& legRotation)
+{
+	model = glm::mat4(
+		glm::vec4(c[1]*c[2], s[0]*s[1]*c[2] + c[0]*s[2], s[0]*s[2] - c[0]*s[1]*c[2], 0.0f),
+		glm::vec4(-c[1]*s[2], c[0]*c[2] - s[0]*s[1]*s[2], c[0]*s[1]*s[2] + s[0]*c[2], 0.0f),
+		glm::vec4(s[1], -s[0]*c[1], c[0]*c[1], 0.0f),
+		glm::vec4(tx, ty, tz, 1.0f));
+	toeRotation = glm::mat4(
+		glm::vec4(1.0f, 0.0f, 0.0f, 0.0f),
+		glm::vec4(0.0f, c[3], s[3], 0.0f),
+		glm::vec4(0.0f, -s[3], c[3], 0.0f),
+		glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	legRotation = glm::mat4(
+		glm::vec4(c[5], c[4]*s[5], s[4]*s[5], 0.0f),
+		glm::vec4(-s[5], c[4]*c[5], s[4]*c[5], 0.0f),
+		glm::vec4(0.0f, -s[4], c[4], 0.0f),
+		glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+}
+
+#ifdef SIMD_X86
+// whole groups of eight poses with vector sines and cosines, returns how many poses were done
+__attribute__((target("avx2")))
+inline int ComputePoseMatricesAVX2(const float* const* dofs, int count, glm::mat4* models, glm::mat4* toeRotations, glm::mat4* legRotations)
+{
+	alignas(32) float sines[6][8];
+	alignas(32) float cosines[6][8];
+	int first = 0;
+	for (; first + 8 <= count; first += 8)
+	{
+		for (int a = 0; a < 6; a++)
+		{
+			__m256 sinX, cosX;
+			// the angles follow the translations in member order
+			SinCosAVX2(_mm256_loadu_ps(dofs[3 + a] + first), sinX, cosX);
+			_mm256_store_ps(sines[a], sinX);
+			_mm256_store_ps(cosines[a], cosX);
+		}
+		for (int lane = 0; lane < 8; lane++)
+		{
+			int i = first + lane;
+			float s[6], c[6];
+			for (int a = 0; a < 6; a++)
+			{
+				s[a] = sines[a][lane];
+				c[a] = cosines[a][lane];
+			}
+			AssemblePoseMatrices(dofs[0][i], dofs[1][i], dofs[2][i], s, c, models[i], toeRotations[i], legRotations[i]);
+		}
+	}
+	return first;
+}
+#endif
+
+// ComputePoseMatrices for count poses given as one array per degree of freedom in PoseParameters member order. The
+// sines and cosines are evaluated eight poses at a time and every matrix is written once, front to back, so the
+// outputs can be write combined mapped buffers.
+inline void ComputePoseMatricesBatch(const float* const* dofs, int count, glm::mat4* models, glm::mat4* toeRotations, glm::mat4* legRotations)
+{
+	int first = 0;
+#ifdef SIMD_X86
+	if (GetCPUFeatures().AVX2)
+	{
+		first = ComputePoseMatricesAVX2(dofs, count, models, toeRotations, legRotations);
+	}
+#endif
+	for (int i = first; i < count; i++)
+	{
+		float s[6], c[6];
+		for (int a = 0; a < 6; a++)
+		{
+			s[a] = std::sin(dofs[3 + a][i]);
+			c[a] = std::cos(dofs[3 + a][i]);
+		}
+		AssemblePoseMatrices(dofs[0][i], dofs[1][i], dofs[2][i], s, c, models[i], toeRotations[i], legRotations[i]);
+	}
+}
@@ -1,7 +1,6 @@
 #pragma once
 
 #include <GL/glew.h>
-#include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -10,8 +9,25 @@
 #include <cstdlib>
 #include <limits>
 #include <chrono>
-
-#include "SkeletonModel.h"
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <cstdarg>
+#include <cassert>
+
+#include "arena.h"
+#include "engine.h"
+#include "jacobian.h"
+#include "lm.h"
+#include "pose.h"
+#include "random.h"
+#include "raycast.h"
+#include "sampling.h"
+#include "softraster.h"
+#include "swarm.h"
+#include "threadpool.h"
 
 static void GLClearError()
 {
@@ -26,85 +42,90 @@ static void GLCheckError()
 	}
 }
 
-struct PoseParameters
+// std430 layout of a particle in the GPU resident swarm, poses are stored in PoseParameters member order
+struct SwarmParticle
 {
-	public:
-		float XTranslation;
-		float YTranslation;
-		float ZTranslation;
-		float XRotation;
-		float YRotation;
-		float ZRotation;
-		float ToeXRot;
-		float LegXRot;
-		float LegZRot;
-
-		PoseParameters() : XTranslation{0.0f}, YTranslation{0.0f}, ZTranslation{0.0f}, XRotation{0.0f}, YRotation{0.0f}, ZRotation{0.0f}, ToeXRot{0.0f}, LegXRot{0.0f}, LegZRot{0.0f} {}
-
-		PoseParameters(float xtrans, float ytrans, float ztrans, float xrot, float yrot, float zrot, float toexrot, float legxrot, float legzrot) : XTranslation{xtrans}, YTranslation{ytrans}, ZTranslation{ztrans}, XRotation{xrot}, YRotation{yrot}, ZRotation{zrot}, ToeXRot{toexrot}, LegXRot{legxrot}, LegZRot{legzrot} {}
-
-		PoseParameters(const PoseParameters &params)
-		{
-			XTranslation = params.XTranslation;
-			YTranslation = params.YTranslation;
-			ZTranslation = params.ZTranslation;
-			XRotation = params.XRotation;
-			YRotation = params.YRotation;
-			ZRotation = params.ZRotation;
-			ToeXRot = params.ToeXRot;
-			LegXRot = params.LegXRot;
-			LegZRot = params.LegZRot;
-		}
-
-		PoseParameters operator+(PoseParameters const &obj) const
-		{
-			return PoseParameters(XTranslation + obj.XTranslation, YTranslation + obj.YTranslation, ZTranslation + obj.ZTranslation, XRotation + obj.XRotation, YRotation + obj.YRotation, ZRotation + obj.ZRotation, ToeXRot + obj.ToeXRot, LegXRot + obj.LegXRot, LegZRot + obj.LegZRot);	
-		}
-
-		PoseParameters operator-(PoseParameters const &obj) const
-		{
-			return PoseParameters(XTranslation - obj.XTranslation, YTranslation - obj.YTranslation, ZTranslation - obj.ZTranslation, XRotation - obj.XRotation, YRotation - obj.YRotation, ZRotation - obj.ZRotation, ToeXRot - obj.ToeXRot, LegXRot - obj.LegXRot, LegZRot - LegZRot);	
-		}
-
-		PoseParameters operator*(float c)
-		{
-			return PoseParameters(c * XTranslation, c * YTranslation, c * ZTranslation, c * XRotation, c * YRotation, c * ZRotation, c * ToeXRot, c * LegXRot, c * LegZRot);
-		}
+	float Position[9];
+	float Velocity[9];
+	float BestPosition[9];
+	float BestEnergy;
+};
 
-		void Assuage(float xT=0.01, float yT=0.01, float zT=0.01, float xR=0.05, float yR=0.05, float zR=0.05)
-		{
-			XTranslation = XTranslation > xT ? xT : XTranslation < -xT ? -xT : XTranslation;
-			YTranslation = YTranslation > yT ? yT : YTranslation < -yT ? -yT : YTranslation;
-			ZTranslation = ZTranslation > zT ? zT : ZTranslation < -zT ? -zT : ZTranslation;
-			XRotation = XRotation > xR ? xR : XRotation < -xR ? -xR : XRotation;
-			YRotation = YRotation > yR ? yR : YRotation < -yR ? -yR : YRotation;
-			ZRotation = ZRotation > zR ? zR : ZRotation < -zR ? -zR : ZRotation;
-		}
+// std430 layout of the global best of the GPU resident swarm
+struct SwarmBest
+{
+	float BestEnergy;
+	GLint BestIndex;
+	float BestPosition[9];
+};
 
-		void AssuagePosition(float toeXMin=glm::radians(-15.0f), float toeXMax=glm::radians(45.0f), float legXMin=glm::radians(-20.0f), float legXMax=glm::radians(45.0f), float legZMin=glm::radians(-45.0f), float legZMax=glm::radians(45.0f))
-		{
-			ToeXRot = ToeXRot < toeXMin ? toeXMin : ToeXRot > toeXMax ? toeXMax : ToeXRot;
-			LegXRot = LegXRot < legXMin ? legXMin : LegXRot > legXMax ? legXMax : LegXRot;
-			LegZRot = LegZRot < legZMin ? legZMin : LegZRot > legZMax ? legZMax : LegZRot;
-		}
+// How the per particle energies are computed from the rendered depth maps
+enum class EnergyMode
+{
+	ReductionChain, // subtraction pass followed by the 2x2 reduction framebuffer chain
+	Fused, // depth pre-pass plus a scoring pass that accumulates straight into an SSBO
+	Compute, // compute shader tree reduction, one work group per particle tile, or only the sampled pixels of it
+	Software // CPU rasterizer spread over a thread pool, needs no OpenGL context, ray casts the sampled pixels instead
+};
 
-		// For debugging only
-		void Print()
-		{
-			std::cout << "XTranslation: " << XTranslation << " YTranslation: " << YTranslation << " ZTranslation: " << ZTranslation << " XRotation: " << XRotation << " YRotation: " << YRotation << " ZRotation: " << ZRotation << " ToeXRot: " << ToeXRot << " LegXRot: " << LegXRot << " LegZRot: " << LegZRot << std::endl;
-		}
+// How the particle depth maps are laid out in the render target
+enum class RenderLayout
+{
+	Atlas, // squashed into tiles of one 2D texture, fragments outside the tile are discarded
+	Layered // one layer of a 2D texture array per particle, clipped by the hardware
 };
 
-class Particle {
+// Why a Run ended before or at its generation limit
+enum class StopReason
+{
+	Iterations, // ran every generation it was given
+	Stagnation, // the global best improved too little over the window
+	Collapse, // the swarm shrank below the minimum diameter
+	Threshold, // the global best reached the target energy
+	Deadline // another generation would not have finished before the deadline
+};
 
-	public:
-		PoseParameters Position;
-		float BestEnergyScore;
-		PoseParameters BestPosition;
-		PoseParameters Velocity;
+inline const char* StopReasonName(StopReason reason)
+{
+	switch (reason)
+	{
+		case StopReason::Stagnation: return "stagnation";
+		case StopReason::Collapse: return "collapse";
+		case StopReason::Threshold: return "threshold";
+		case StopReason::Deadline: return "deadline";
+		default: return "iterations";
+	}
+}
 
-		Particle(): Position{PoseParameters()}, BestEnergyScore{std::numeric_limits<float>::infinity()}, BestPosition{PoseParameters()}, Velocity{PoseParameters()} {}
+// Rules that end a Run early, each one is off at its default. Energies are the mean |ref - rendered| of a tile.
+struct StoppingCriteria
+{
+	// stop once the global best improved by less than MinImprovement, relative, over the last Window generations
+	int Window;
+	float MinImprovement;
+	// stop once the bounding box of the particle positions has a diagonal below MinDiameter, translations and
+	// angles in radians taken as they are
+	float MinDiameter;
+	// stop once the global best energy is at or below EnergyThreshold
+	float EnergyThreshold;
+
+	StoppingCriteria() : Window{10}, MinImprovement{0.0f}, MinDiameter{0.0f}, EnergyThreshold{0.0f} {}
+};
 
+// Outcome of a Run, with how much of the time budget it used. Times are wall clock milliseconds from the call, the
+// budget is 0 without a deadline.
+struct RunResult
+{
+	PoseParameters Position;
+	float Energy;
+	int Generations;
+	StopReason Reason;
+	double BudgetMs;
+	double ElapsedMs;
+	double MeanGenerationMs;
+	double SlowestGenerationMs;
+	// LM iterations run on the swarm's best pose
+	int RefineIterations;
 };
 
 class PSO {
@@ -114,24 +135,125 @@ class PSO {
 		float CognitiveConst;
 		float SocialConst;
 		float ConstrictionConst;
-		// OpenGL vars
-		GLFWwindow* window;
+		EnergyMode Mode;
+		RenderLayout Layout;
+		bool ResidentSwarm;
+		// particles are rendered into an atlas of 128x128 tiles or a layer each, several passes are made when they don't all fit
+		int AtlasColumns, AtlasRows, PassCapacity;
+		int TargetWidth, TargetHeight;
+		// OpenGL vars, the context, programs and foot model are borrowed from the engine
+		Engine& engine;
 		glm::mat4 ProjMat;
 		glm::mat4 MeshToBoneToe, MeshToBoneLeg, BoneToMeshToe, BoneToMeshLeg;
-		Shader RepeatShader, SubtractionShader, RTTShader, R2Shader, PTShader;
-		SkeletonModel footSkeleton;
+		Shader SubtractionShader, RTTShader, R2Shader, PTShader, RTTDepthShader, RTTScoreShader, RTTIDShader;
+		ComputeShader ReductionShader, SampledShader, SwarmShader;
 		// quads, textures, and buffers
-		GLuint quadVAO, quadVBO, repeatQuadVAO, repeatQuadVBO, refdepthtex, peng, repeattex, ping, depthtexture, pong, difftex, pang, tex64, pung, tex32, pling, tex16, plang, tex8, plong, tex4, plung, tex2, pleng, tex1;
-		// instance buffers
-		GLuint instanceVBO, transformationInstanceBuffer, rottoeVB, rotlegVB;
+		GLuint quadVAO{0}, quadVBO{0}, refdepthtex{0}, ping{0}, depthtexture{0}, lineardepthtex{0}, pong{0}, difftex{0}, pang{0}, tex64{0}, pung{0}, tex32{0}, pling{0}, tex16{0}, plang{0}, tex8{0}, plong{0}, tex4{0}, plung{0}, tex2{0}, pleng{0}, tex1{0};
+		// instance buffers, the matrix ones are persistently mapped rings of InstanceRingSize slots
+		static const int InstanceRingSize = 3;
+		GLuint transformationInstanceBuffer, rottoeVB, rotlegVB;
+		// the PSO's own vertex array over the foot mesh buffers, so its instance attributes never touch the engine's VAO
+		GLuint meshVAO{0};
+		glm::mat4 *Movements, *ToeRotations, *LegRotations;
+		GLsync InstanceFences[InstanceRingSize];
+		// per particle energies on the GPU
+		GLuint energyBuffer;
+		float BackgroundEnergy;
+		// particles and global best of the GPU resident swarm
+		GLuint particleBuffer, globalBestBuffer;
+		// asynchronous energy readback
+		GLuint readbackBuffer;
+		void* ReadbackPtr;
+		GLsync ReadbackFence;
+		std::vector<double> StallTimes;
+		// sparse energy, 0 samples scores every pixel
+		int SampleCount;
+		SampleSet Samples;
+		std::vector<GLint> PackedSamples;
+		GLuint sampleBuffer;
+		GLsizeiptr SampleBufferBytes;
+		// software energy
+		std::unique_ptr<SoftwareRasterizer> Rasterizer;
+		// the pool every CPU stage shares
+		ThreadPool* Pool{nullptr};
+		std::vector<PoseParameters> SoftwarePoses;
+		std::vector<RayCaster> Casters;
+		// early termination, rows in the order they are summed, the bound of every particle and the pixels it skipped
+		std::vector<int> RowOrder;
+		std::vector<float> Bounds;
+		std::vector<int> SkippedPixels;
+		// random factors of the velocity update, and the seed of the GPU swarm
+		RandomStream Random;
+		// the CPU swarm and the memory of one generation, kept across runs so a warm tracking session never allocates
+		std::unique_ptr<Swarm> Particles;
+		Arena Scratch;
+		// a Run has left personal bests in Particles that a resumed Run can carry over
+		bool HaveSwarm;
+		// early stopping, with the global best energies of the last Window generations in a ring
+		StoppingCriteria Stopping;
+		std::vector<float> BestHistory;
+		// LM refinement of the global best, run after the swarm
+		int RefineIterations;
+		std::unique_ptr<LMRefiner> Refiner;
+		// the rows of atlas tiles an LM batch covers, read back at once and split into tiles on the CPU
+		std::vector<float> AtlasDepths;
+		// analytic LM Jacobians from a triangle ID and barycentric target, ray cast in software mode
+		bool AnalyticJacobian;
+		std::unique_ptr<PoseJacobian> Jacobian;
+		std::unique_ptr<RayCaster> IDCaster;
+		std::vector<float> IDImage;
+		GLuint idFramebuffer{0}, idtexture{0}, iddepth{0};
+
+		// generation log written into scratch memory, it is printed while the GPU renders the next generation
+		struct LogBuffer
+		{
+			char* Text;
+			size_t Capacity;
+			size_t Length;
+
+			void Append(const char* format, ...)
+			{
+				va_list args;
+				va_start(args, format);
+				int written = std::vsnprintf(Text + Length, Capacity - Length, format, args);
+				va_end(args);
+				// a full buffer drops the rest of the lines rather than growing
+				Length = written < 0 ? Length : std::min(Capacity - 1, Length + written);
+			}
+		};
 
 	public:
-		PSO(int numParticles, float CogConst=2.8, float SocConst=1.3) : 
+		PSO(Engine& renderEngine, int numParticles, float CogConst=2.8, float SocConst=1.3, EnergyMode energyMode=EnergyMode::ReductionChain, RenderLayout renderLayout=RenderLayout::Atlas, bool residentSwarm=false) : 
 			NumParticles{numParticles},	
 			CognitiveConst{CogConst}, 
 			SocialConst{SocConst}, 
 			ConstrictionConst{0.0f}, 
-			window{nullptr}
+			Mode{energyMode},
+			Layout{renderLayout},
+			ResidentSwarm{residentSwarm},
+			AtlasColumns{1},
+			AtlasRows{1},
+			PassCapacity{1},
+			TargetWidth{128},
+			TargetHeight{128},
+			engine(renderEngine),
+			Movements{nullptr},
+			ToeRotations{nullptr},
+			LegRotations{nullptr},
+			InstanceFences{},
+			energyBuffer{0},
+			BackgroundEnergy{0.0f},
+			particleBuffer{0},
+			globalBestBuffer{0},
+			readbackBuffer{0},
+			ReadbackPtr{nullptr},
+			ReadbackFence{0},
+			SampleCount{0},
+			sampleBuffer{0},
+			SampleBufferBytes{0},
+			HaveSwarm{false},
+			RefineIterations{0},
+			AnalyticJacobian{false}
 		{
 			float Phi = CognitiveConst + SocialConst;
 			if (Phi <= 4) 
@@ -140,128 +262,128 @@ class PSO {
 			}
 			ConstrictionConst = 2.0f / std::abs(2.0f - Phi - sqrt(Phi*Phi-4*Phi));
 			
-			// Initialize GLFW
-			if (!glfwInit())
+			// the reduction chain works on 2D textures only
+			if (Layout == RenderLayout::Layered && Mode == EnergyMode::ReductionChain)
 			{
-				std::cerr << "WARNING: GLFW not initialized properly" << std::endl;
+				std::cerr << "WARNING: Layered rendering needs the fused or compute energy, falling back to the atlas" << std::endl;
+				Layout = RenderLayout::Atlas;
 			}
 
-			window = glfwCreateWindow(128*NumParticles, 128, "PSO", NULL, NULL);
-
-			// Check to see if the window is valid
-			if (!window)
+			// the software energy creates no GL objects at all, the particles are scored on the CPU
+			if (Mode == EnergyMode::Software)
 			{
-				glfwTerminate();
-				std::cerr << "WARNING: GLFW window was not created properly" << std::endl;
+				if (ResidentSwarm)
+				{
+					std::cerr << "WARNING: The resident swarm needs a GPU energy, updating the particles on the CPU" << std::endl;
+					ResidentSwarm = false;
+				}
+				Rasterizer.reset(new SoftwareRasterizer(engine.footSkeleton.meshes[0]));
+				Pool = &ThreadPool::Shared();
+				Pool->ForEachThread([&](int) {
+					Rasterizer->Warm();
+				});
+				SoftwarePoses.resize(NumParticles);
+				Bounds.resize(NumParticles);
+				SkippedPixels.resize(NumParticles);
+				Particles.reset(new Swarm(NumParticles));
+				return;
 			}
 
-			// Make the window's context current and then hide it
-			glfwMakeContextCurrent(window);
-			glfwHideWindow(window);
-
-			// Initialize GLEW
-			glewExperimental = true;
-			if (glewInit() != GLEW_OK)
+			if (Layout == RenderLayout::Layered)
+			{
+				// one layer per particle, as many as a layered framebuffer can hold
+				GLint maxLayers = 0;
+				GLint maxFramebufferLayers = 0;
+				glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+				glGetIntegerv(GL_MAX_FRAMEBUFFER_LAYERS, &maxFramebufferLayers);
+				PassCapacity = std::min(NumParticles, std::max(1, std::min(maxLayers, maxFramebufferLayers)));
+			}
+			else
 			{
-				std::cerr << "WARNING: GLEW not initialized properly" << std::endl;
+				// lay the tiles out as wide as the texture and viewport limits allow, then wrap into rows
+				GLint maxTextureSize = 0;
+				GLint maxViewportDims[2] = {0, 0};
+				glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+				glGetIntegerv(GL_MAX_VIEWPORT_DIMS, maxViewportDims);
+				int maxColumns = std::max(1, std::min(maxTextureSize, maxViewportDims[0]) / 128);
+				int maxRows = std::max(1, std::min(maxTextureSize, maxViewportDims[1]) / 128);
+				AtlasColumns = std::min(NumParticles, maxColumns);
+				AtlasRows = std::min((NumParticles + AtlasColumns - 1) / AtlasColumns, maxRows);
+				PassCapacity = AtlasColumns*AtlasRows;
+				TargetWidth = AtlasColumns*128;
+				TargetHeight = AtlasRows*128;
 			}
 
 			ProjMat = glm::perspective(glm::radians(42.0f), 1.0f, 0.05f, 1.0f);
 
 			// Get and set up shaders
-			RepeatShader = Shader("../res/shaders/PTVS.glsl", "../res/shaders/PTFSRepeat.glsl");
-			SubtractionShader = Shader("../res/shaders/SubtractionVertexShader.glsl", "../res/shaders/SubtractionFragmentShader.glsl");
-			RTTShader = Shader("../res/shaders/RTTVShader.glsl", "../res/shaders/RTTFShader.glsl");
-			R2Shader = Shader("../res/shaders/PassThroughQuadVertexShader.glsl", "../res/shaders/Reduction2FShader.glsl");
-			PTShader = Shader("../res/shaders/PTVS.glsl", "../res/shaders/PTFS.glsl");
-
-			// Load the skeleton and associated bone matrices
-			footSkeleton = SkeletonModel("../res/foot_full.dae");	
-			MeshToBoneLeg = footSkeleton.meshes[0].offsetMatricies[0];
-			MeshToBoneToe = footSkeleton.meshes[0].offsetMatricies[2];
-			BoneToMeshLeg = glm::inverse(MeshToBoneLeg);
-			BoneToMeshToe = glm::inverse(MeshToBoneToe);	
-
-			float translations[numParticles];
-			for (int i = 0; i < NumParticles; i++)
+			SubtractionShader = engine.GetShader("../res/shaders/SubtractionVertexShader.glsl", "../res/shaders/SubtractionFragmentShader.glsl");
+			R2Shader = engine.GetShader("../res/shaders/PassThroughQuadVertexShader.glsl", "../res/shaders/Reduction2FShader.glsl");
+			PTShader = engine.GetShader("../res/shaders/PTVS.glsl", "../res/shaders/PTFS.glsl");
+			if (Layout == RenderLayout::Layered)
+			{
+				// a pass-through geometry shader picks the layer, so no fragment has to be discarded
+				RTTShader = engine.GetShader("../res/shaders/RTTLayeredVShader.glsl", "../res/shaders/RTTLayeredFShader.glsl", "../res/shaders/RTTLayeredGShader.glsl");
+				if (Mode == EnergyMode::Fused)
+				{
+					RTTDepthShader = engine.GetShader("../res/shaders/RTTLayeredVShader.glsl", "../res/shaders/RTTLayeredDepthFShader.glsl", "../res/shaders/RTTLayeredGShader.glsl");
+					RTTScoreShader = engine.GetShader("../res/shaders/RTTLayeredVShader.glsl", "../res/shaders/RTTLayeredScoreFShader.glsl", "../res/shaders/RTTLayeredGShader.glsl");
+				}
+				if (Mode == EnergyMode::Compute)
+				{
+					ReductionShader = engine.GetComputeShader("../res/shaders/ReductionLayeredCShader.glsl");
+					SampledShader = engine.GetComputeShader("../res/shaders/SampledLayeredCShader.glsl");
+				}
+			}
+			else
 			{
-				translations[i] = i*2.0/NumParticles;
+				RTTShader = engine.GetShader("../res/shaders/RTTVShader.glsl", "../res/shaders/RTTFShader.glsl");
+				if (Mode == EnergyMode::Fused)
+				{
+					RTTDepthShader = engine.GetShader("../res/shaders/RTTVShader.glsl", "../res/shaders/RTTDepthFShader.glsl");
+					RTTScoreShader = engine.GetShader("../res/shaders/RTTVShader.glsl", "../res/shaders/RTTScoreFShader.glsl");
+				}
+				if (Mode == EnergyMode::Compute)
+				{
+					ReductionShader = engine.GetComputeShader("../res/shaders/ReductionCShader.glsl");
+					SampledShader = engine.GetComputeShader("../res/shaders/SampledCShader.glsl");
+				}
 			}
 
-			// set up the instance VBO for offsets
-			glGenBuffers(1, &instanceVBO);
-			glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float)*NumParticles, &translations[0], GL_STATIC_DRAW);
+			if (ResidentSwarm)
+			{
+				SwarmShader = engine.GetComputeShader("../res/shaders/SwarmUpdateCShader.glsl");
+			}
+			else
+			{
+				Particles.reset(new Swarm(NumParticles));
+			}
 
-			glBindVertexArray(footSkeleton.meshes[0].VAO);
-			glEnableVertexAttribArray(2);
-			glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
-			glVertexAttribDivisor(2, 1);
-
-			GLsizei vec4Size = sizeof(glm::vec4);
-			// set up the instance VBO for model matricies
-			glGenBuffers(1, &transformationInstanceBuffer);
-			glBindBuffer(GL_ARRAY_BUFFER, transformationInstanceBuffer);
-			glBufferData(GL_ARRAY_BUFFER, NumParticles*sizeof(glm::mat4), nullptr, GL_STATIC_DRAW);
-
-			glBindVertexArray(footSkeleton.meshes[0].VAO);
-
-			glEnableVertexAttribArray(3);
-			glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)0);
-			glEnableVertexAttribArray(4);
-			glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)(vec4Size));
-			glEnableVertexAttribArray(5);
-			glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)(2*vec4Size));
-			glEnableVertexAttribArray(6);
-			glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)(3*vec4Size));
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
-			glVertexAttribDivisor(3, 1);
-			glVertexAttribDivisor(4, 1);
-			glVertexAttribDivisor(5, 1);
-			glVertexAttribDivisor(6, 1);
-
-			// set up the instance VBO for toe matricies
-			glGenBuffers(1, &rottoeVB);
-			glBindBuffer(GL_ARRAY_BUFFER, rottoeVB);
-			glBufferData(GL_ARRAY_BUFFER, NumParticles*sizeof(glm::mat4), nullptr, GL_STATIC_DRAW);
-
-			glBindVertexArray(footSkeleton.meshes[0].VAO);
-
-			glEnableVertexAttribArray(7);
-			glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)0);
-			glEnableVertexAttribArray(8);
-			glVertexAttribPointer(8, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)(vec4Size));
-			glEnableVertexAttribArray(9);
-			glVertexAttribPointer(9, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)(2*vec4Size));
-			glEnableVertexAttribArray(10);
-			glVertexAttribPointer(10, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)(3*vec4Size));
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
-			glVertexAttribDivisor(7, 1);
-			glVertexAttribDivisor(8, 1);
-			glVertexAttribDivisor(9, 1);
-			glVertexAttribDivisor(10, 1);
-			
-			// set up the instance VBO for model matricies
-			glGenBuffers(1, &rotlegVB);
-			glBindBuffer(GL_ARRAY_BUFFER, rotlegVB);
-			glBufferData(GL_ARRAY_BUFFER, NumParticles*sizeof(glm::mat4), nullptr, GL_STATIC_DRAW);
-
-			glBindVertexArray(footSkeleton.meshes[0].VAO);
-
-			glEnableVertexAttribArray(11);
-			glVertexAttribPointer(11, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)0);
-			glEnableVertexAttribArray(12);
-			glVertexAttribPointer(12, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)(vec4Size));
-			glEnableVertexAttribArray(13);
-			glVertexAttribPointer(13, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)(2*vec4Size));
-			glEnableVertexAttribArray(14);
-			glVertexAttribPointer(14, 4, GL_FLOAT, GL_FALSE, 4*vec4Size, (void*)(3*vec4Size));
+			// bone matrices of the shared foot model
+			MeshToBoneLeg = engine.MeshToBoneLeg;
+			MeshToBoneToe = engine.MeshToBoneToe;
+			BoneToMeshLeg = engine.BoneToMeshLeg;
+			BoneToMeshToe = engine.BoneToMeshToe;
+
+			// set up the persistently mapped instance VBOs for model, toe and leg matricies, one region per ring slot
+			GLbitfield mapFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			GLsizeiptr ringBytes = InstanceRingSize*NumParticles*sizeof(glm::mat4);
+			GLuint* matrixBuffers[3] = {&transformationInstanceBuffer, &rottoeVB, &rotlegVB};
+			glm::mat4** mappedMatrices[3] = {&Movements, &ToeRotations, &LegRotations};
+			for (int m = 0; m < 3; m++)
+			{
+				glGenBuffers(1, matrixBuffers[m]);
+				glBindBuffer(GL_ARRAY_BUFFER, *matrixBuffers[m]);
+				glBufferStorage(GL_ARRAY_BUFFER, ringBytes, nullptr, mapFlags);
+				*mappedMatrices[m] = static_cast<glm::mat4*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, ringBytes, mapFlags));
+			}
 			glBindBuffer(GL_ARRAY_BUFFER, 0);
-			glVertexAttribDivisor(11, 1);
-			glVertexAttribDivisor(12, 1);
-			glVertexAttribDivisor(13, 1);
-			glVertexAttribDivisor(14, 1);
+
+			meshVAO = engine.footSkeleton.meshes[0].CreateVertexArray();
+			SetupMatrixAttribute(3, transformationInstanceBuffer);
+			SetupMatrixAttribute(7, rottoeVB);
+			SetupMatrixAttribute(11, rotlegVB);
+			glBindVertexArray(0);
 
 			float quadVertices[] = {
 				// positions   // texCoords
@@ -274,17 +396,6 @@ class PSO {
 				1.0f,  1.0f,  1.0f, 0.0f
 			};
 
-			float repeatQuadVertices[] = {
-				// positions   // texCoords
-				-1.0f,  1.0f,  0.0f, 0.0f,
-				-1.0f, -1.0f,  0.0f, 1.0f,
-				1.0f, -1.0f,  1.0f*NumParticles, 1.0f,
-
-				-1.0f,  1.0f,  0.0f, 0.0f,
-				1.0f, -1.0f,  1.0f*NumParticles, 1.0f,
-				1.0f,  1.0f,  1.0f*NumParticles, 0.0f
-			};
-
 			// declare quad
 			glGenVertexArrays(1, &quadVAO);
 			glGenBuffers(1, &quadVBO);
@@ -298,169 +409,235 @@ class PSO {
 
 			glBindVertexArray(0);
 
-			// declare repeat quad
-			glGenVertexArrays(1, &repeatQuadVAO);
-			glGenBuffers(1, &repeatQuadVBO);
-			glBindVertexArray(repeatQuadVAO);
-			glBindBuffer(GL_ARRAY_BUFFER, repeatQuadVBO);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(repeatQuadVertices), &repeatQuadVertices, GL_STATIC_DRAW);
-			glEnableVertexAttribArray(0);
-			glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
-			glEnableVertexAttribArray(1);
-			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
-
-			glBindVertexArray(0);
-
-			// set up peng 
-			glGenFramebuffers(1, &peng);
-			glBindFramebuffer(GL_FRAMEBUFFER, peng);
-
-			// reference depth map on repeat
-			glGenTextures(1, &repeattex);
-			glActiveTexture(GL_TEXTURE0 + 1);
-			glBindTexture(GL_TEXTURE_2D, repeattex);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*128, 128, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+			// reference image in texture 0, every Run uploads its frame into the same storage
+			glGenTextures(1, &refdepthtex);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, refdepthtex);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 128, 128, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, repeattex, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
 			// set up ping
 			glGenFramebuffers(1, &ping);
 			glBindFramebuffer(GL_FRAMEBUFFER, ping);
 
-			// rendered models in line
+			// rendered models, one tile per particle in the atlas or one layer per particle in the array
 			glGenTextures(1, &depthtexture);
 			glActiveTexture(GL_TEXTURE0 + 2);
-			glBindTexture(GL_TEXTURE_2D, depthtexture);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*128, 128, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthtexture, 0);
-
-			// set up pong 
-			glGenFramebuffers(1, &pong);
-			glBindFramebuffer(GL_FRAMEBUFFER, pong);
-
-			// texture that is the difference of reference and rendered
-			glGenTextures(1, &difftex);
-			glActiveTexture(GL_TEXTURE0 + 3);
-			glBindTexture(GL_TEXTURE_2D, difftex);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*128, 128, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, difftex, 0);
-
-			// set up pang 
-			glGenFramebuffers(1, &pang);
-			glBindFramebuffer(GL_FRAMEBUFFER, pang);
-
-			// Nx64x64 texture
-			glGenTextures(1, &tex64);
-			glActiveTexture(GL_TEXTURE0 + 4);
-			glBindTexture(GL_TEXTURE_2D, tex64);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*64, 64, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex64, 0);
+			if (Layout == RenderLayout::Layered)
+			{
+				glBindTexture(GL_TEXTURE_2D_ARRAY, depthtexture);
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, 128, 128, PassCapacity, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+				glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthtexture, 0);
+
+				// the linear depth goes to a color layer, the depth buffer keeps the hardware depth so early-z stays on,
+				// it replaces the depth array on texture unit 2 for the compute energy
+				glGenTextures(1, &lineardepthtex);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, lineardepthtex);
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, 128, 128, PassCapacity, 0, GL_RED, GL_FLOAT, 0);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+				glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, lineardepthtex, 0);
+			}
+			else
+			{
+				glBindTexture(GL_TEXTURE_2D, depthtexture);
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, AtlasColumns*128, AtlasRows*128, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);	
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthtexture, 0);
+			}
 
-			// set up pung
-			glGenFramebuffers(1, &pung);
-			glBindFramebuffer(GL_FRAMEBUFFER, pung);
+			// the subtraction and reduction framebuffers are only needed by the chain
+			if (Mode == EnergyMode::ReductionChain)
+			{
+				SetupReductionChain();
+			}
 
-			// Nx32x32 texture
-			glGenTextures(1, &tex32);
-			glActiveTexture(GL_TEXTURE0 + 5);
-			glBindTexture(GL_TEXTURE_2D, tex32);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*32, 32, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex32, 0);
+			// one energy per particle, fixed point accumulators for the fused mode and float averages otherwise
+			// the chain packs whole atlases, so round up to a full atlas per pass
+			int numPasses = (NumParticles + PassCapacity - 1) / PassCapacity;
+			GLsizeiptr readbackBytes = numPasses*PassCapacity*sizeof(float);
+			glGenBuffers(1, &energyBuffer);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, energyBuffer);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, readbackBytes, nullptr, GL_DYNAMIC_COPY);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+			// the resident swarm never leaves the GPU until the final global best is read back
+			if (ResidentSwarm)
+			{
+				glGenBuffers(1, &particleBuffer);
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleBuffer);
+				glBufferData(GL_SHADER_STORAGE_BUFFER, NumParticles*sizeof(SwarmParticle), nullptr, GL_DYNAMIC_COPY);
+				glGenBuffers(1, &globalBestBuffer);
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, globalBestBuffer);
+				glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(SwarmBest), nullptr, GL_DYNAMIC_READ);
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+			}
 
-			// set up pling	
-			glGenFramebuffers(1, &pling);
-			glBindFramebuffer(GL_FRAMEBUFFER, pling);
+			// persistently mapped buffer the energies are copied into, read once its fence has signaled
+			glGenBuffers(1, &readbackBuffer);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffer);
+			glBufferStorage(GL_PIXEL_PACK_BUFFER, readbackBytes, nullptr, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+			ReadbackPtr = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readbackBytes, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
 
-			// Nx16x16 texture
-			glGenTextures(1, &tex16);
-			glActiveTexture(GL_TEXTURE0 + 6);
-			glBindTexture(GL_TEXTURE_2D, tex16);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*16, 16, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex16, 0);
+		// frees everything the PSO created, the engine keeps the context, programs and foot model
+		~PSO()
+		{
+			if (Mode == EnergyMode::Software)
+			{
+				return;
+			}
 
-			// set up plang
-			glGenFramebuffers(1, &plang);
-			glBindFramebuffer(GL_FRAMEBUFFER, plang);
+			for (int slot = 0; slot < InstanceRingSize; slot++)
+			{
+				glDeleteSync(InstanceFences[slot]);
+			}
+			glDeleteSync(ReadbackFence);
+
+			GLuint buffers[] = {quadVBO, transformationInstanceBuffer, rottoeVB, rotlegVB, energyBuffer, particleBuffer, globalBestBuffer, readbackBuffer, sampleBuffer};
+			glDeleteBuffers(sizeof(buffers)/sizeof(GLuint), buffers);
+			GLuint framebuffers[] = {ping, pong, pang, pung, pling, plang, plong, plung, pleng, idFramebuffer};
+			glDeleteFramebuffers(sizeof(framebuffers)/sizeof(GLuint), framebuffers);
+			GLuint textures[] = {refdepthtex, depthtexture, lineardepthtex, difftex, tex64, tex32, tex16, tex8, tex4, tex2, tex1, idtexture};
+			glDeleteTextures(sizeof(textures)/sizeof(GLuint), textures);
+			glDeleteRenderbuffers(1, &iddepth);
+			GLuint vertexArrays[] = {quadVAO, meshVAO};
+			glDeleteVertexArrays(sizeof(vertexArrays)/sizeof(GLuint), vertexArrays);
+		}
 
-			// Nx8x8 texture
-			glGenTextures(1, &tex8);
-			glActiveTexture(GL_TEXTURE0 + 7);
-			glBindTexture(GL_TEXTURE_2D, tex8);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*8, 8, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex8, 0);
+		int GetNumParticles() const
+		{
+			return NumParticles;
+		}
 
-			// set up plong
-			glGenFramebuffers(1, &plong);
-			glBindFramebuffer(GL_FRAMEBUFFER, plong);
+		// Time in microseconds spent blocked on the energy readback, one entry per generation of the last Run
+		const std::vector<double>& GetStallTimes() const
+		{
+			return StallTimes;
+		}
 
-			// Nx4x4 texture
-			glGenTextures(1, &tex4);
-			glActiveTexture(GL_TEXTURE0 + 8);
-			glBindTexture(GL_TEXTURE_2D, tex4);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*4, 4, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex4, 0);
+		// Score only about count pixels per particle from the next Run on, picked once per reference frame and weighted
+		// toward the silhouette, 0 goes back to every pixel. Used by the compute and software energies.
+		void SetSampleCount(int count)
+		{
+			if (count > 0 && (Mode == EnergyMode::ReductionChain || Mode == EnergyMode::Fused))
+			{
+				std::cerr << "WARNING: Sampled scoring needs the compute or software energy, scoring every pixel" << std::endl;
+				count = 0;
+			}
+			SampleCount = std::max(0, count);
+			if (SampleCount > 0 && Mode == EnergyMode::Software && Casters.empty())
+			{
+				// the casters are refit for every pose, so each pool thread gets its own
+				Casters.assign(Pool->Size(), RayCaster(engine.footSkeleton.meshes[0]));
+			}
+		}
 
-			// set up plung
-			glGenFramebuffers(1, &plung);
-			glBindFramebuffer(GL_FRAMEBUFFER, plung);
+		// Rules for ending later Runs before their generation limit. The resident swarm keeps its energies on the GPU and
+		// always runs every generation.
+		void SetStoppingCriteria(const StoppingCriteria& criteria)
+		{
+			Stopping = criteria;
+			Stopping.Window = std::max(1, Stopping.Window);
+			BestHistory.assign(Stopping.Window, std::numeric_limits<float>::infinity());
+			if (ResidentSwarm && (Stopping.MinImprovement > 0.0f || Stopping.MinDiameter > 0.0f || Stopping.EnergyThreshold > 0.0f))
+			{
+				std::cerr << "WARNING: The resident swarm runs every generation, stopping criteria are ignored" << std::endl;
+			}
+		}
 
-			// Nx2x2 texture
-			glGenTextures(1, &tex2);
-			glActiveTexture(GL_TEXTURE0 + 9);
-			glBindTexture(GL_TEXTURE_2D, tex2);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*2, 2, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex2, 0);
+		// Polish the best pose of later Runs with up to iterations Levenberg-Marquardt steps, 0 turns it off. Each one
+		// renders the pose and its 18 central difference perturbations through the particle render targets, so a few
+		// of them cost about as much as a few generations and can stand in for the slow tail of the swarm. With
+		// analyticJacobian each step renders the pose once into a triangle ID target and differentiates it exactly.
+		void SetRefinement(int iterations, bool analyticJacobian=false)
+		{
+			RefineIterations = std::max(0, iterations);
+			AnalyticJacobian = analyticJacobian;
+			if (RefineIterations > 0 && !Refiner)
+			{
+				Refiner.reset(new LMRefiner());
+			}
+			if (RefineIterations > 0 && AnalyticJacobian && !Jacobian)
+			{
+				Jacobian.reset(new PoseJacobian(engine.footSkeleton.meshes[0]));
+				IDImage.resize(4*128*128);
+				if (Mode == EnergyMode::Software)
+				{
+					IDCaster.reset(new RayCaster(engine.footSkeleton.meshes[0]));
+				}
+				else
+				{
+					SetupIDTarget();
+				}
+			}
+		}
 
-			// set up pleng
-			glGenFramebuffers(1, &pleng);
-			glBindFramebuffer(GL_FRAMEBUFFER, pleng);
+		// restart the random numbers of the swarm, runs from the same seed and stream draw the same factors
+		void SetSeed(uint64_t seed, uint64_t stream=0)
+		{
+			Random.Seed(seed, stream);
+		}
 
-			// Nx1x1 texture
-			glGenTextures(1, &tex1);
-			glActiveTexture(GL_TEXTURE0 + 10);
-			glBindTexture(GL_TEXTURE_2D, tex1);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, NumParticles*1, 1, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex1, 0);
+		// Optimize from the poses in parameterList within a wall clock deadline, for a fixed camera rate. A generation is
+		// only started when the slowest one so far would still finish in time, the first one always runs so there is a
+		// best pose to return. maxIters and the stopping criteria can end it sooner, resume works as in Run.
+		RunResult RunUntil(PoseParameters* parameterList, float* refImg, std::chrono::high_resolution_clock::time_point deadline, int maxIters, bool resume=false)
+		{
+			return Run(parameterList, refImg, maxIters, deadline, resume);
 		}
 
-		PoseParameters Run(PoseParameters* parameterList, float* refImg, int iters)
+		// Optimize from the poses in parameterList for at most iters generations, stopping early by the criteria set. With
+		// resume the swarm of the last Run carries over to the new frame: the particles restart from parameterList, the
+		// personal bests are kept but scored again against refImg, and the best of them starts as the global best.
+		RunResult Run(PoseParameters* parameterList, float* refImg, int iters, std::chrono::high_resolution_clock::time_point deadline=std::chrono::high_resolution_clock::time_point::max(), bool resume=false)
 		{	
-			// Load reference image into texture 0
-			glGenTextures(1, &refdepthtex);
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, refdepthtex);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 128, 128, 0, GL_DEPTH_COMPONENT, GL_FLOAT, refImg);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);	
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			auto runStart = std::chrono::high_resolution_clock::now();
+			bool hasDeadline = deadline != std::chrono::high_resolution_clock::time_point::max();
 
-			glEnable(GL_DEPTH_TEST);
+			LoadReference(refImg);
+
+			if (ResidentSwarm)
+			{
+				if (hasDeadline)
+				{
+					std::cerr << "WARNING: The resident swarm cannot time its generations without stalling, running every generation" << std::endl;
+				}
+				if (resume)
+				{
+					std::cerr << "WARNING: The resident swarm keeps no personal bests between runs, starting a new swarm" << std::endl;
+				}
+				RunResult result = RunResident(parameterList, iters);
+				Refine(result, refImg, hasDeadline, deadline);
+				result.BudgetMs = hasDeadline ? std::chrono::duration<double, std::milli>(deadline - runStart).count() : 0.0;
+				result.ElapsedMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - runStart).count();
+				return result;
+			}
 
 			// Intialize particles
-			Particle* particles = new Particle[NumParticles];
-			for (int i = 0; i < NumParticles; i++)
+			Swarm& particles = *Particles;
+			PoseParameters GlobalBestPosition;
+			float GlobalBestEnergy = std::numeric_limits<float>::infinity();
+			// one readback per generation and one for scoring the carried over bests
+			StallTimes.clear();
+			StallTimes.reserve(iters + 1);
+			if (resume && HaveSwarm)
 			{
-				particles[i].Position = parameterList[i];
+				RescoreBests(particles, refImg, GlobalBestPosition, GlobalBestEnergy);
+				particles.Restart(parameterList);
 			}
+			else
+			{
+				particles.Initialize(parameterList);
+			}
+			HaveSwarm = true;
 
 			// BEGIN TESTING CODE
 			//glm::mat4* Movements = new glm::mat4[NumParticles];
@@ -538,173 +715,993 @@ class PSO {
 			// Time the PSO without setup
 			auto start = std::chrono::high_resolution_clock::now();
 			// Setup finished, start the particle swarm!
-			PoseParameters GlobalBestPosition;
-			float GlobalBestEnergy = std::numeric_limits<float>::infinity();
+			LogBuffer log = {nullptr, 0, 0};
+			RunResult result = {PoseParameters(), 0.0f, 0, StopReason::Iterations, 0.0, 0.0, 0.0, 0.0, 0};
+			if (hasDeadline)
+			{
+				result.BudgetMs = std::chrono::duration<double, std::milli>(deadline - runStart).count();
+			}
+			double totalGenerationMs = 0.0;
+#ifndef NDEBUG
+			// only set once generation 1 has started, a Run that stops sooner has no warm part to check
+			long long warmAllocations = -1;
+#endif
 
 			for (int generation = 0; generation < iters; generation++)
 			{
-				glm::mat4* Movements = new glm::mat4[NumParticles];
-				glm::mat4* ToeRotations = new glm::mat4[NumParticles];
-				glm::mat4* LegRotations = new glm::mat4[NumParticles];
-				for (int i = 0; i < NumParticles; i++)
+				// the slowest generation so far is the estimate, so jitter rarely pushes the last one past the deadline
+				auto generationStart = std::chrono::high_resolution_clock::now();
+				if (hasDeadline && generation > 0 && generationStart + std::chrono::duration<double, std::milli>(result.SlowestGenerationMs) > deadline)
 				{
-					PoseParameters currparam = particles[i].Position;
-					// Set up MVP matricies
-					glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(currparam.XTranslation, currparam.YTranslation, currparam.ZTranslation));
-					model = glm::rotate(glm::rotate(glm::rotate(model, currparam.XRotation, glm::vec3(1, 0, 0)), currparam.YRotation, glm::vec3(0, 1, 0)), currparam.ZRotation, glm::vec3(0, 0, 1));
-					Movements[i] = model;	
-					ToeRotations[i] = glm::rotate(glm::rotate(glm::rotate(glm::mat4(1.0f), currparam.ToeXRot, glm::vec3(1, 0, 0)), 0.0f, glm::vec3(0, 1, 0)), 0.0f, glm::vec3(0, 0, 1));
-					LegRotations[i] = glm::rotate(glm::rotate(glm::rotate(glm::mat4(1.0f), currparam.LegXRot, glm::vec3(1, 0, 0)), 0.0f, glm::vec3(0, 1, 0)), currparam.LegZRot, glm::vec3(0, 0, 1));
+					result.Reason = StopReason::Deadline;
+					break;
 				}
 
-				glNamedBufferSubData(transformationInstanceBuffer, 0, NumParticles*sizeof(glm::mat4), &Movements[0]);
-				glNamedBufferSubData(rottoeVB, 0, NumParticles*sizeof(glm::mat4), &ToeRotations[0]);
-				glNamedBufferSubData(rotlegVB, 0, NumParticles*sizeof(glm::mat4), &LegRotations[0]);
-
-				RepeatShader.use();
-				RepeatShader.setInt("tex", 0);
-				glBindFramebuffer(GL_FRAMEBUFFER, peng);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				glBindVertexArray(repeatQuadVAO);
-				glDrawArrays(GL_TRIANGLES, 0, 6);
-
-				glEnable(GL_DEPTH_TEST);
-				//Send matricies to shader
-				RTTShader.use(); 
-				RTTShader.setMat4("u_P", ProjMat);
-				RTTShader.setInt("instances", NumParticles);
-				RTTShader.setFloat("zNear", 0.05f);
-				RTTShader.setFloat("zFar", 1.0f);
-				RTTShader.setMat4("m2btoe", MeshToBoneToe);
-				RTTShader.setMat4("m2bleg", MeshToBoneLeg);
-				RTTShader.setMat4("b2mtoe", BoneToMeshToe);
-				RTTShader.setMat4("b2mleg", BoneToMeshLeg);
+				// the GPU energies are only queued here and collected below
+				if (Mode != EnergyMode::Software)
+				{
+					SubmitGeneration(particles, generation);
+				}
 
-				glBindFramebuffer(GL_FRAMEBUFFER, ping);
-				glClear(GL_DEPTH_BUFFER_BIT);
-
-				RTTShader.use();
-				glBindVertexArray(footSkeleton.meshes[0].VAO);
-				glDrawElementsInstanced(GL_TRIANGLES, footSkeleton.meshes[0].indices.size(), GL_UNSIGNED_INT, 0, NumParticles);
-
-				glBindFramebuffer(GL_FRAMEBUFFER, pong);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				SubtractionShader.use();
-				SubtractionShader.setInt("screenTexture", 1);
-				SubtractionShader.setInt("gendepTexture", 2);
-				glBindVertexArray(quadVAO);
-				glDrawArrays(GL_TRIANGLES, 0, 6);
-
-				glBindFramebuffer(GL_FRAMEBUFFER, pang);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				R2Shader.use();
-				R2Shader.setInt("tex", 3);
-				R2Shader.setFloat("width", NumParticles*128.0f);
-				R2Shader.setFloat("height", 128.0f);
-				glDrawArrays(GL_TRIANGLES, 0 , 6);
-
-				glBindFramebuffer(GL_FRAMEBUFFER, pung);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				R2Shader.use();
-				R2Shader.setInt("tex", 4);
-				R2Shader.setFloat("width", NumParticles*64.0f);
-				R2Shader.setFloat("height", 64.0f);
-				glViewport(0, 0, NumParticles*64, 64);
-				glDrawArrays(GL_TRIANGLES, 0 , 6);
-
-				glBindFramebuffer(GL_FRAMEBUFFER, pling);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				R2Shader.use();
-				R2Shader.setInt("tex", 5);
-				R2Shader.setFloat("width", NumParticles*32.0f);
-				R2Shader.setFloat("height", 32.0f);
-				glViewport(0, 0, NumParticles*32, 32);
-				glDrawArrays(GL_TRIANGLES, 0 , 6);
-
-				glBindFramebuffer(GL_FRAMEBUFFER, plang);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				R2Shader.use();
-				R2Shader.setInt("tex", 6);
-				R2Shader.setFloat("width", NumParticles*16.0f);
-				R2Shader.setFloat("height", 16.0f);
-				glViewport(0, 0, NumParticles*16, 16);
-				glDrawArrays(GL_TRIANGLES, 0 , 6);
-
-				glBindFramebuffer(GL_FRAMEBUFFER, plong);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				R2Shader.use();
-				R2Shader.setInt("tex", 7);
-				R2Shader.setFloat("width", NumParticles*8.0f);
-				R2Shader.setFloat("height", 8.0f);
-				glViewport(0, 0, NumParticles*8, 8);
-				glDrawArrays(GL_TRIANGLES, 0 , 6);
-
-				glBindFramebuffer(GL_FRAMEBUFFER, plung);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				R2Shader.use();
-				R2Shader.setInt("tex", 8);
-				R2Shader.setFloat("width", NumParticles*4.0f);
-				R2Shader.setFloat("height", 4.0f);
-				glViewport(0, 0, NumParticles*4, 4);
-				glDrawArrays(GL_TRIANGLES, 0 , 6);
-
-				glBindFramebuffer(GL_FRAMEBUFFER, pleng);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				R2Shader.use();
-				R2Shader.setInt("tex", 9);
-				R2Shader.setFloat("width", NumParticles*2.0f);
-				R2Shader.setFloat("height", 2.0f);
-				glViewport(0, 0, NumParticles*2, 2);
-				glDrawArrays(GL_TRIANGLES, 0 , 6);
-
-				glBindFramebuffer(GL_FRAMEBUFFER, 0);
-				glClear(GL_DEPTH_BUFFER_BIT);
-				PTShader.use();
-				PTShader.setInt("tex", 9);
-				glBindVertexArray(quadVAO);
-				glViewport(0, 0, NumParticles*128, 128);
-				glDrawArrays(GL_TRIANGLES, 0, 6);
-
-				float* currentdt = new float[NumParticles];
-				glGetTextureImage(tex1, 0, GL_DEPTH_COMPONENT, GL_FLOAT, sizeof(float)*NumParticles, currentdt);
+				// CPU work that does not depend on this generation's energies runs while the GPU renders
+				std::cout.write(log.Text, log.Length);
+				Scratch.Reset();
+#ifndef NDEBUG
+				// the first generation sizes the scratch memory and this Reset grows it, after that nothing may allocate
+				if (generation == 1)
+				{
+					warmAllocations = AllocationCount();
+				}
+#endif
+				// room for the two lines of every particle and the swarm lines
+				log = {Scratch.Allocate<char>(96*NumParticles + 128), 96*(size_t) NumParticles + 128, 0};
+				Random.Fill(particles.R1, NumParticles);
+				Random.Fill(particles.R2, NumParticles);
+
+				float* currentdt = Scratch.Allocate<float>(NumParticles);
+				if (Mode == EnergyMode::Software)
+				{
+					long skipped = ScoreSoftware(particles, refImg, currentdt);
+					log.Append("skipped pixels: %ld\n", skipped);
+				}
+				else
+				{
+					CollectEnergies(currentdt);
+				}
 
 				// first loop to update local bests and global best
 				for (int p = 0; p < NumParticles; p++)
 				{
-					if (currentdt[p] < particles[p].BestEnergyScore)
+					if (currentdt[p] < particles.BestEnergy[p])
 					{
-						particles[p].BestEnergyScore = currentdt[p];
-						particles[p].BestPosition = particles[p].Position;
+						particles.BestEnergy[p] = currentdt[p];
+						for (int d = 0; d < Swarm::NumDOF; d++)
+						{
+							particles.BestPosition[d][p] = particles.Position[d][p];
+						}
 						if (currentdt[p] < GlobalBestEnergy)
 						{
 							GlobalBestEnergy = currentdt[p];
-							GlobalBestPosition = particles[p].Position;
+							GlobalBestPosition = particles.GetPosition(p);
 						}
 						//std::cout << "cie: " << currentdt[p]*128*128 << std::endl;
-						//std::cout << "cbes for particle " << p << ": " << particles[p].BestEnergyScore*128*128 << std::endl;
+						//std::cout << "cbes for particle " << p << ": " << particles.BestEnergy[p]*128*128 << std::endl;
 					}
-					std::cout << "cie: " << currentdt[p]*128*128 << std::endl;
-					std::cout << "cbes for particle " << p << ": " << particles[p].BestEnergyScore*128*128 << std::endl;
+					log.Append("cie: %g\n", currentdt[p]*128*128);
+					log.Append("cbes for particle %d: %g\n", p, particles.BestEnergy[p]*128*128);
 				}
-				std::cout << "gbe: " << GlobalBestEnergy*128*128 << std::endl;
+				log.Append("gbe: %g\n", GlobalBestEnergy*128*128);
 
-				// second loop to update position and velocities
-				for (int p = 0; p < NumParticles; p++)
+				result.Generations = generation + 1;
+				bool stop = ShouldStop(particles, generation, GlobalBestEnergy, result.Reason);
+				if (!stop)
+				{
+					// then update position and velocities, one vectorized pass per degree of freedom
+					particles.Update(GlobalBestPosition, CognitiveConst, SocialConst, ConstrictionConst);
+				}
+
+				double generationMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - generationStart).count();
+				totalGenerationMs += generationMs;
+				result.SlowestGenerationMs = std::max(result.SlowestGenerationMs, generationMs);
+				if (stop)
 				{
-					float r1 = ((float) std::rand() / RAND_MAX);
-					float r2 = ((float) std::rand() / RAND_MAX);
-					PoseParameters personalVelocity = (particles[p].BestPosition - particles[p].Position)*CognitiveConst*r1;
-					PoseParameters socialVelocity = (GlobalBestPosition - particles[p].Position)*SocialConst*r2;
-					particles[p].Velocity = particles[p].Velocity + (personalVelocity + socialVelocity)*ConstrictionConst;
-					particles[p].Velocity.Assuage();
-					particles[p].Position = particles[p].Position + particles[p].Velocity; 
-					particles[p].Position.AssuagePosition();
+					break;
 				}
-				delete[] currentdt;
 			}
 
+			std::cout.write(log.Text, log.Length);
+			std::cout << std::flush;
+#ifndef NDEBUG
+			assert(warmAllocations < 0 || AllocationCount() == warmAllocations);
+#endif
+			result.Position = GlobalBestPosition;
+			result.Energy = GlobalBestEnergy;
+			result.MeanGenerationMs = result.Generations > 0 ? totalGenerationMs / result.Generations : 0.0;
+			Refine(result, refImg, hasDeadline, deadline);
+
 			auto end = std::chrono::high_resolution_clock::now();
 			std::cout << "Time it took for PSO to execute without OpenGL setup is: " << std::chrono::duration_cast<std::chrono::milliseconds> (end-start).count() << std::endl;
-			return GlobalBestPosition;
+			double totalStall = 0.0;
+			for (double stall : StallTimes)
+			{
+				totalStall += stall;
+			}
+			std::cout << "Average energy readback stall per generation (us): " << (StallTimes.empty() ? 0.0 : totalStall / StallTimes.size()) << std::endl;
+			std::cout << "Stopped after " << result.Generations << " generations: " << StopReasonName(result.Reason) << std::endl;
+			result.ElapsedMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - runStart).count();
+			if (hasDeadline)
+			{
+				std::cout << "Used " << result.ElapsedMs << " of " << result.BudgetMs << " ms, slowest generation " << result.SlowestGenerationMs << " ms" << std::endl;
+			}
+			return result;
+		}
+
+		// Energy of each of the NumParticles poses against refImg, rendered and scored like a generation of Run without
+		// touching the swarm, for checking the energy modes against each other. The software energy scores every pixel.
+		void Score(const PoseParameters* poses, float* refImg, float* energies)
+		{
+			LoadReference(refImg);
+			if (Mode == EnergyMode::Software)
+			{
+				Rasterizer->Energies(poses, NumParticles, refImg, energies, *Pool);
+				return;
+			}
+			WaitForInstanceSlot(0);
+			for (int i = 0; i < NumParticles; i++)
+			{
+				ComputePoseMatrices(poses[i], Movements[i], ToeRotations[i], LegRotations[i]);
+			}
+			BindInstanceSlot(0);
+			SubmitEnergies();
+			InstanceFences[0] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			ReadbackFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			CollectEnergies(energies);
+		}
+
+	private:
+		// upload a new 128x128 reference and everything derived from it that the energies use
+		void LoadReference(float* refImg)
+		{
+			if (Mode != EnergyMode::Software)
+			{
+				// Load reference image into texture 0
+				glTextureSubImage2D(refdepthtex, 0, 0, 0, 128, 128, GL_DEPTH_COMPONENT, GL_FLOAT, refImg);
+				glActiveTexture(GL_TEXTURE0);
+				glBindTexture(GL_TEXTURE_2D, refdepthtex);
+
+				glEnable(GL_DEPTH_TEST);
+			}
+
+			// Energy of a tile with nothing rendered in it, the fused scoring pass only adds the difference to it
+			BackgroundEnergy = 0.0f;
+			for (int i = 0; i < 128*128; i++)
+			{
+				BackgroundEnergy += std::abs(refImg[i] - 1.0f);
+			}
+
+			if (Mode == EnergyMode::Software)
+			{
+				SilhouetteRowOrder(refImg, RowOrder);
+			}
+
+			// the sampled pixels only depend on the reference, so they are picked once here
+			StratifiedSamples(refImg, SampleCount, Samples);
+			if (Mode != EnergyMode::Software && !Samples.Pixels.empty())
+			{
+				// std430 pairs of the packed pixel and its weight
+				PackedSamples.resize(2*Samples.Pixels.size());
+				for (size_t i = 0; i < Samples.Pixels.size(); i++)
+				{
+					PackedSamples[2*i] = Samples.Pixels[i].X | (Samples.Pixels[i].Y << 16);
+					std::memcpy(&PackedSamples[2*i + 1], &Samples.Weights[i], sizeof(float));
+				}
+				if (!sampleBuffer)
+				{
+					glGenBuffers(1, &sampleBuffer);
+				}
+				// the storage is only reallocated when a frame picks more samples than any before it
+				GLsizeiptr bytes = PackedSamples.size()*sizeof(GLint);
+				if (bytes > SampleBufferBytes)
+				{
+					glNamedBufferData(sampleBuffer, bytes, PackedSamples.data(), GL_DYNAMIC_DRAW);
+					SampleBufferBytes = bytes;
+				}
+				else
+				{
+					glNamedBufferSubData(sampleBuffer, 0, bytes, PackedSamples.data());
+				}
+			}
+		}
+
+		// PSO loop with the particles kept in SSBOs, the compute shader updates them and builds the instance matrices
+		RunResult RunResident(PoseParameters* parameterList, int iters)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+
+			Scratch.Reset();
+			SwarmParticle* particles = Scratch.Allocate<SwarmParticle>(NumParticles);
+			for (int i = 0; i < NumParticles; i++)
+			{
+				PoseToArray(parameterList[i], particles[i].Position);
+				PoseToArray(PoseParameters(), particles[i].Velocity);
+				PoseToArray(parameterList[i], particles[i].BestPosition);
+				particles[i].BestEnergy = std::numeric_limits<float>::infinity();
+			}
+			glNamedBufferSubData(particleBuffer, 0, NumParticles*sizeof(SwarmParticle), particles);
+
+			SwarmBest globalBest;
+			globalBest.BestEnergy = std::numeric_limits<float>::infinity();
+			globalBest.BestIndex = -1;
+			PoseToArray(PoseParameters(), globalBest.BestPosition);
+			glNamedBufferSubData(globalBestBuffer, 0, sizeof(SwarmBest), &globalBest);
+
+			// the compute shader writes the matrices of every generation into the first ring slot
+			for (int slot = 0; slot < InstanceRingSize; slot++)
+			{
+				WaitForInstanceSlot(slot);
+			}
+			BindInstanceSlot(0);
+
+			SwarmShader.use();
+			SwarmShader.setInt("numParticles", NumParticles);
+			SwarmShader.setFloat("cognitiveConst", CognitiveConst);
+			SwarmShader.setFloat("socialConst", SocialConst);
+			SwarmShader.setFloat("constrictionConst", ConstrictionConst);
+			SwarmShader.setBool("fixedPoint", Mode == EnergyMode::Fused);
+			SwarmShader.setFloat("backgroundEnergy", BackgroundEnergy);
+			SwarmShader.setUint("seed", Random.Next());
+			DispatchSwarmUpdate(0, true);
+
+			for (int generation = 0; generation < iters; generation++)
+			{
+				glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+				SubmitEnergies(false);
+				glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+				DispatchSwarmUpdate(generation, false);
+			}
+
+			// the only readback of the run
+			glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+			glGetNamedBufferSubData(globalBestBuffer, 0, sizeof(SwarmBest), &globalBest);
+			std::cout << "gbe: " << globalBest.BestEnergy*128*128 << std::endl;
+
+			auto end = std::chrono::high_resolution_clock::now();
+			std::cout << "Time it took for PSO to execute without OpenGL setup is: " << std::chrono::duration_cast<std::chrono::milliseconds> (end-start).count() << std::endl;
+			double elapsedMs = std::chrono::duration<double, std::milli>(end - start).count();
+			RunResult result = {ArrayToPose(globalBest.BestPosition), globalBest.BestEnergy, iters, StopReason::Iterations, 0.0, elapsedMs, iters > 0 ? elapsedMs / iters : 0.0, 0.0, 0};
+			return result;
+		}
+
+		// LM iterations from the best pose of the swarm, as many as fit before the deadline when there is one. The LM
+		// minimizes squared residuals, so its pose is only kept when it also has the lower energy. Once an iteration has
+		// run, the energy of the result is the dense one over the whole tile, also when the swarm scored samples.
+		void Refine(RunResult& result, const float* refImg, bool hasDeadline, std::chrono::high_resolution_clock::time_point deadline)
+		{
+			if (RefineIterations <= 0 || !std::isfinite(result.Energy))
+			{
+				return;
+			}
+			Refiner->Start(result.Position, refImg);
+			double slowestMs = 0.0;
+			for (int iteration = 0; iteration < RefineIterations; iteration++)
+			{
+				auto iterationStart = std::chrono::high_resolution_clock::now();
+				if (hasDeadline && iterationStart + std::chrono::duration<double, std::milli>(slowestMs) > deadline)
+				{
+					// a swarm that stopped early keeps its reason, the deadline only explains a run that used every generation
+					if (result.Reason == StopReason::Iterations)
+					{
+						result.Reason = StopReason::Deadline;
+					}
+					break;
+				}
+				bool improving;
+				if (AnalyticJacobian)
+				{
+					improving = Refiner->IterateAnalytic([&](const PoseParameters& pose, float* tiles) {
+						RenderIDTile(pose, IDImage.data());
+						Jacobian->Compute(pose, IDImage.data(), tiles);
+					});
+				}
+				else
+				{
+					improving = Refiner->Iterate([&](const PoseParameters* poses, int count, float* depths) {
+						RenderDepthTiles(poses, count, depths);
+					});
+				}
+				result.RefineIterations = iteration + 1;
+				slowestMs = std::max(slowestMs, std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - iterationStart).count());
+				if (!improving)
+				{
+					break;
+				}
+			}
+			// the swarm's energy may be a sampled estimate, so both poses are compared by the dense energy the LM measured
+			if (!std::isfinite(Refiner->StartEnergy()))
+			{
+				return;
+			}
+			std::cout << "LM refined gbe from " << Refiner->StartEnergy()*128*128 << " to " << Refiner->Energy()*128*128 << " in " << result.RefineIterations << " iterations" << std::endl;
+			result.Energy = Refiner->StartEnergy();
+			if (Refiner->Energy() < result.Energy)
+			{
+				result.Position = Refiner->Pose();
+				result.Energy = Refiner->Energy();
+			}
+		}
+
+		// linear depth tiles of a few poses, row 0 at the bottom, rendered through the particle instance slots and render
+		// target and read back, or rasterized on the pool in software mode
+		void RenderDepthTiles(const PoseParameters* poses, int count, float* depths)
+		{
+			if (Mode == EnergyMode::Software)
+			{
+				Pool->ParallelFor(count, [&](int i) {
+					Rasterizer->Render(poses[i], depths + i*128*128);
+				});
+				return;
+			}
+
+			// the ring slot holds NumParticles matrices and the target PassCapacity tiles
+			int capacity = std::min(NumParticles, PassCapacity);
+			for (int first = 0; first < count; first += capacity)
+			{
+				int batch = std::min(capacity, count - first);
+				WaitForInstanceSlot(0);
+				for (int i = 0; i < batch; i++)
+				{
+					ComputePoseMatrices(poses[first + i], Movements[i], ToeRotations[i], LegRotations[i]);
+				}
+				BindInstanceSlot(0);
+
+				glEnable(GL_DEPTH_TEST);
+				glBindFramebuffer(GL_FRAMEBUFFER, ping);
+				glViewport(0, 0, TargetWidth, TargetHeight);
+				ClearTarget();
+				SetRenderUniforms(RTTShader);
+				DrawParticles(0, batch);
+				InstanceFences[0] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+				if (Layout == RenderLayout::Layered)
+				{
+					// the layers already lie tile after tile, so the whole batch is read straight into place
+					glGetTextureSubImage(lineardepthtex, 0, 0, 0, 0, 128, 128, batch, GL_RED, GL_FLOAT, batch*128*128*sizeof(float), depths + first*128*128);
+				}
+				else
+				{
+					// one readback of the rows the batch covers, the buffer only grows on the first call
+					int width = std::min(batch, AtlasColumns)*128;
+					int height = (batch + AtlasColumns - 1) / AtlasColumns*128;
+					AtlasDepths.resize(width*height);
+					glGetTextureSubImage(depthtexture, 0, 0, 0, 0, width, height, 1, GL_DEPTH_COMPONENT, GL_FLOAT, width*height*sizeof(float), AtlasDepths.data());
+					for (int i = 0; i < batch; i++)
+					{
+						const float* tile = AtlasDepths.data() + 128*(i / AtlasColumns)*width + 128*(i % AtlasColumns);
+						float* out = depths + (first + i)*128*128;
+						for (int y = 0; y < 128; y++)
+						{
+							std::copy(tile + y*width, tile + y*width + 128, out + y*128);
+						}
+					}
+				}
+			}
+		}
+
+		// 128x128 float RGBA target the triangle ID pass writes into, with its own depth buffer
+		void SetupIDTarget()
+		{
+			RTTIDShader = engine.GetShader("../res/shaders/RTTVShader.glsl", "../res/shaders/RTTIDFShader.glsl", "../res/shaders/RTTIDGShader.glsl");
+
+			glGenFramebuffers(1, &idFramebuffer);
+			glBindFramebuffer(GL_FRAMEBUFFER, idFramebuffer);
+			glGenTextures(1, &idtexture);
+			glActiveTexture(GL_TEXTURE0 + 11);
+			glBindTexture(GL_TEXTURE_2D, idtexture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 128, 128, 0, GL_RGBA, GL_FLOAT, nullptr);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, idtexture, 0);
+			glGenRenderbuffers(1, &iddepth);
+			glBindRenderbuffer(GL_RENDERBUFFER, iddepth);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, 128, 128);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, iddepth);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			{
+				std::cerr << "WARNING: triangle ID framebuffer setup was not successful" << std::endl;
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		}
+
+		// triangle, barycentrics and linear depth of every pixel of one pose, 4 floats a pixel with row 0 at the bottom
+		void RenderIDTile(const PoseParameters& pose, float* idImage)
+		{
+			if (Mode == EnergyMode::Software)
+			{
+				IDCaster->SetPose(pose);
+				Pool->ParallelFor(128, [&](int y) {
+					for (int x = 0; x < 128; x++)
+					{
+						PixelCoord pixel = {(uint16_t) x, (uint16_t) y};
+						IDCaster->Identify(pixel, idImage + 4*(y*128 + x));
+					}
+				});
+				return;
+			}
+
+			WaitForInstanceSlot(0);
+			ComputePoseMatrices(pose, Movements[0], ToeRotations[0], LegRotations[0]);
+			BindInstanceSlot(0);
+
+			glEnable(GL_DEPTH_TEST);
+			glBindFramebuffer(GL_FRAMEBUFFER, idFramebuffer);
+			glViewport(0, 0, 128, 128);
+			// background has no triangle and the far plane depth
+			const GLfloat background[4] = {-1.0f, 0.0f, 0.0f, 1.0f};
+			glClearBufferfv(GL_COLOR, 0, background);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			// one pose filling the whole target
+			SetRenderUniforms(RTTIDShader);
+			RTTIDShader.setInt("atlasColumns", 1);
+			RTTIDShader.setInt("atlasRows", 1);
+			DrawParticles(0, 1);
+			InstanceFences[0] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glGetTextureImage(idtexture, 0, GL_RGBA, GL_FLOAT, 4*128*128*sizeof(float), idImage);
+		}
+
+		// Score the personal bests of the last Run against a new reference, the energies they were kept with belong to the
+		// old frame. Costs one generation's render, and leaves the particles at their bests.
+		void RescoreBests(Swarm& particles, const float* refImg, PoseParameters& globalBestPosition, float& globalBestEnergy)
+		{
+			for (int d = 0; d < Swarm::NumDOF; d++)
+			{
+				std::copy(particles.BestPosition[d], particles.BestPosition[d] + NumParticles, particles.Position[d]);
+			}
+			// no bound for the software early termination, every best needs its full energy
+			for (int p = 0; p < NumParticles; p++)
+			{
+				particles.BestEnergy[p] = std::numeric_limits<float>::infinity();
+			}
+			Scratch.Reset();
+			float* energies = Scratch.Allocate<float>(NumParticles);
+			if (Mode == EnergyMode::Software)
+			{
+				ScoreSoftware(particles, refImg, energies);
+			}
+			else
+			{
+				SubmitGeneration(particles, 0);
+				CollectEnergies(energies);
+			}
+			for (int p = 0; p < NumParticles; p++)
+			{
+				particles.BestEnergy[p] = energies[p];
+				if (energies[p] < globalBestEnergy)
+				{
+					globalBestEnergy = energies[p];
+					globalBestPosition = particles.GetBestPosition(p);
+				}
+			}
+		}
+
+		// check the stopping criteria after the bests of a generation are updated
+		bool ShouldStop(const Swarm& particles, int generation, float globalBestEnergy, StopReason& reason)
+		{
+			if (Stopping.EnergyThreshold > 0.0f && globalBestEnergy <= Stopping.EnergyThreshold)
+			{
+				reason = StopReason::Threshold;
+				return true;
+			}
+
+			if (Stopping.MinImprovement > 0.0f)
+			{
+				// the slot of this generation still holds the best from Window generations ago
+				float& previous = BestHistory[generation % Stopping.Window];
+				bool stagnant = generation >= Stopping.Window && previous - globalBestEnergy < Stopping.MinImprovement*previous;
+				previous = globalBestEnergy;
+				if (stagnant)
+				{
+					reason = StopReason::Stagnation;
+					return true;
+				}
+			}
+
+			if (Stopping.MinDiameter > 0.0f)
+			{
+				float diagonal = 0.0f;
+				for (int d = 0; d < Swarm::NumDOF; d++)
+				{
+					const float* x = particles.Position[d];
+					float min = x[0], max = x[0];
+					for (int p = 1; p < NumParticles; p++)
+					{
+						min = std::min(min, x[p]);
+						max = std::max(max, x[p]);
+					}
+					diagonal += (max - min)*(max - min);
+				}
+				if (std::sqrt(diagonal) < Stopping.MinDiameter)
+				{
+					reason = StopReason::Collapse;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// write this generation's matrices straight into a ring slot the GPU is done with, then queue the render and scoring
+		void SubmitGeneration(const Swarm& particles, int generation)
+		{
+			int slot = generation % InstanceRingSize;
+			WaitForInstanceSlot(slot);
+			glm::mat4* movements = Movements + slot*NumParticles;
+			glm::mat4* toeRotations = ToeRotations + slot*NumParticles;
+			glm::mat4* legRotations = LegRotations + slot*NumParticles;
+			ComputePoseMatricesBatch(particles.Position, NumParticles, movements, toeRotations, legRotations);
+			BindInstanceSlot(slot);
+
+			SubmitEnergies();
+			InstanceFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			ReadbackFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glFlush();
+		}
+
+		// Rasterize and score every particle on the CPU, or ray cast just the sampled pixels. The global best is never above
+		// a personal best, so a particle stops being scored once it is above its own, its energy is then only a lower bound
+		// that is still good enough for the log. Returns the number of pixels skipped over the swarm.
+		long ScoreSoftware(const Swarm& particles, const float* refImg, float* energies)
+		{
+			for (int p = 0; p < NumParticles; p++)
+			{
+				SoftwarePoses[p] = particles.GetPosition(p);
+				Bounds[p] = particles.BestEnergy[p];
+			}
+			if (!Samples.Pixels.empty())
+			{
+				Pool->ParallelFor(NumParticles, [&](int p) {
+					RayCaster& caster = Casters[ThreadPool::CurrentWorker()];
+					caster.SetPose(SoftwarePoses[p]);
+					energies[p] = caster.Energy(Samples.Pixels.data(), Samples.Weights.data(), Samples.Pixels.size(), refImg, Bounds[p], SkippedPixels[p]);
+				});
+			}
+			else
+			{
+				Rasterizer->BoundedEnergies(SoftwarePoses.data(), Bounds.data(), NumParticles, refImg, RowOrder.data(), energies, SkippedPixels.data(), *Pool);
+			}
+			long skipped = 0;
+			for (int p = 0; p < NumParticles; p++)
+			{
+				skipped += SkippedPixels[p];
+			}
+			return skipped;
+		}
+
+		// one work group runs the best update, the velocity update and the pose to matrix conversion
+		void DispatchSwarmUpdate(int generation, bool initialize)
+		{
+			GLsizeiptr matrixBytes = NumParticles*sizeof(glm::mat4);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, energyBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, particleBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, globalBestBuffer);
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, transformationInstanceBuffer, 0, matrixBytes);
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 4, rottoeVB, 0, matrixBytes);
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 5, rotlegVB, 0, matrixBytes);
+
+			SwarmShader.use();
+			SwarmShader.setUint("generation", generation);
+			SwarmShader.setBool("initialize", initialize);
+			glDispatchCompute(1, 1, 1);
+		}
+
+		static void PoseToArray(const PoseParameters& pose, float* values)
+		{
+			values[0] = pose.XTranslation;
+			values[1] = pose.YTranslation;
+			values[2] = pose.ZTranslation;
+			values[3] = pose.XRotation;
+			values[4] = pose.YRotation;
+			values[5] = pose.ZRotation;
+			values[6] = pose.ToeXRot;
+			values[7] = pose.LegXRot;
+			values[8] = pose.LegZRot;
+		}
+
+		static PoseParameters ArrayToPose(const float* values)
+		{
+			return PoseParameters(values[0], values[1], values[2], values[3], values[4], values[5], values[6], values[7], values[8]);
+		}
+
+		// point the four vec4 columns of an instanced matrix attribute at their own buffer binding
+		void SetupMatrixAttribute(GLuint location, GLuint buffer)
+		{
+			GLuint vao = meshVAO;
+			for (GLuint column = 0; column < 4; column++)
+			{
+				glEnableVertexArrayAttrib(vao, location + column);
+				glVertexArrayAttribFormat(vao, location + column, 4, GL_FLOAT, GL_FALSE, column*sizeof(glm::vec4));
+				glVertexArrayAttribBinding(vao, location + column, location);
+			}
+			glVertexArrayBindingDivisor(vao, location, 1);
+			glVertexArrayVertexBuffer(vao, location, buffer, 0, sizeof(glm::mat4));
+		}
+
+		// block until the draws that last read this ring slot have finished
+		void WaitForInstanceSlot(int slot)
+		{
+			if (!InstanceFences[slot])
+			{
+				return;
+			}
+			GLenum status = glClientWaitSync(InstanceFences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			while (status == GL_TIMEOUT_EXPIRED)
+			{
+				status = glClientWaitSync(InstanceFences[slot], 0, 1000000000);
+			}
+			glDeleteSync(InstanceFences[slot]);
+			InstanceFences[slot] = 0;
+		}
+
+		// make the instanced draws read their matrices from one ring slot
+		void BindInstanceSlot(int slot)
+		{
+			GLuint vao = meshVAO;
+			GLintptr offset = slot*NumParticles*sizeof(glm::mat4);
+			glVertexArrayVertexBuffer(vao, 3, transformationInstanceBuffer, offset, sizeof(glm::mat4));
+			glVertexArrayVertexBuffer(vao, 7, rottoeVB, offset, sizeof(glm::mat4));
+			glVertexArrayVertexBuffer(vao, 11, rotlegVB, offset, sizeof(glm::mat4));
+		}
+
+		// framebuffers for the subtraction pass and the 2x2 reduction chain
+		void SetupReductionChain()
+		{
+			// set up pong 
+			glGenFramebuffers(1, &pong);
+			glBindFramebuffer(GL_FRAMEBUFFER, pong);
+
+			// texture that is the difference of reference and rendered
+			glGenTextures(1, &difftex);
+			glActiveTexture(GL_TEXTURE0 + 3);
+			glBindTexture(GL_TEXTURE_2D, difftex);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, AtlasColumns*128, AtlasRows*128, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);	
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, difftex, 0);
+
+			// set up pang 
+			glGenFramebuffers(1, &pang);
+			glBindFramebuffer(GL_FRAMEBUFFER, pang);
+
+			// atlas of 64x64 tiles
+			glGenTextures(1, &tex64);
+			glActiveTexture(GL_TEXTURE0 + 4);
+			glBindTexture(GL_TEXTURE_2D, tex64);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, AtlasColumns*64, AtlasRows*64, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex64, 0);
+
+			// set up pung
+			glGenFramebuffers(1, &pung);
+			glBindFramebuffer(GL_FRAMEBUFFER, pung);
+
+			// atlas of 32x32 tiles
+			glGenTextures(1, &tex32);
+			glActiveTexture(GL_TEXTURE0 + 5);
+			glBindTexture(GL_TEXTURE_2D, tex32);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, AtlasColumns*32, AtlasRows*32, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex32, 0);
+
+			// set up pling	
+			glGenFramebuffers(1, &pling);
+			glBindFramebuffer(GL_FRAMEBUFFER, pling);
+
+			// atlas of 16x16 tiles
+			glGenTextures(1, &tex16);
+			glActiveTexture(GL_TEXTURE0 + 6);
+			glBindTexture(GL_TEXTURE_2D, tex16);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, AtlasColumns*16, AtlasRows*16, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex16, 0);
+
+			// set up plang
+			glGenFramebuffers(1, &plang);
+			glBindFramebuffer(GL_FRAMEBUFFER, plang);
+
+			// atlas of 8x8 tiles
+			glGenTextures(1, &tex8);
+			glActiveTexture(GL_TEXTURE0 + 7);
+			glBindTexture(GL_TEXTURE_2D, tex8);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, AtlasColumns*8, AtlasRows*8, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex8, 0);
+
+			// set up plong
+			glGenFramebuffers(1, &plong);
+			glBindFramebuffer(GL_FRAMEBUFFER, plong);
+
+			// atlas of 4x4 tiles
+			glGenTextures(1, &tex4);
+			glActiveTexture(GL_TEXTURE0 + 8);
+			glBindTexture(GL_TEXTURE_2D, tex4);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, AtlasColumns*4, AtlasRows*4, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex4, 0);
+
+			// set up plung
+			glGenFramebuffers(1, &plung);
+			glBindFramebuffer(GL_FRAMEBUFFER, plung);
+
+			// atlas of 2x2 tiles
+			glGenTextures(1, &tex2);
+			glActiveTexture(GL_TEXTURE0 + 9);
+			glBindTexture(GL_TEXTURE_2D, tex2);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, AtlasColumns*2, AtlasRows*2, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex2, 0);
+
+			// set up pleng
+			glGenFramebuffers(1, &pleng);
+			glBindFramebuffer(GL_FRAMEBUFFER, pleng);
+
+			// atlas of 1x1 tiles
+			glGenTextures(1, &tex1);
+			glActiveTexture(GL_TEXTURE0 + 10);
+			glBindTexture(GL_TEXTURE_2D, tex1);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, AtlasColumns*1, AtlasRows*1, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);	
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex1, 0);
+		}
+
+		// upload the matrices shared by every instanced render of the foot
+		void SetRenderUniforms(Shader& shader)
+		{
+			shader.use();
+			shader.setMat4("u_P", ProjMat);
+			shader.setInt("atlasColumns", AtlasColumns);
+			shader.setInt("atlasRows", AtlasRows);
+			shader.setFloat("zNear", 0.05f);
+			shader.setFloat("zFar", 1.0f);
+			shader.setMat4("m2btoe", MeshToBoneToe);
+			shader.setMat4("m2bleg", MeshToBoneLeg);
+			shader.setMat4("b2mtoe", BoneToMeshToe);
+			shader.setMat4("b2mleg", BoneToMeshLeg);
+		}
+
+		// clear the depth of the bound target, and the layered linear depth to the far plane the depth buffer clears to
+		void ClearTarget()
+		{
+			glClear(GL_DEPTH_BUFFER_BIT);
+			if (Layout == RenderLayout::Layered)
+			{
+				const GLfloat farPlane[] = {1.0f, 0.0f, 0.0f, 0.0f};
+				glClearBufferfv(GL_COLOR, 0, farPlane);
+			}
+		}
+
+		// instanced draw of particles [first, first + count) into atlas tiles or layers 0 to count - 1
+		void DrawParticles(int first, int count)
+		{
+			glBindVertexArray(meshVAO);
+			glDrawElementsInstancedBaseInstance(GL_TRIANGLES, engine.footSkeleton.meshes[0].indices.size(), GL_UNSIGNED_INT, 0, count, first);
+		}
+
+		// render and score every particle into energyBuffer, then queue the copy of the energies into the readback buffer
+		void SubmitEnergies(bool readback=true)
+		{
+			if (Mode == EnergyMode::Fused)
+			{
+				GLint zero = 0;
+				glClearNamedBufferData(energyBuffer, GL_R32I, GL_RED_INTEGER, GL_INT, &zero);
+			}
+
+			// particles that do not fit in one atlas or texture array are rendered and scored in several passes
+			for (int first = 0; first < NumParticles; first += PassCapacity)
+			{
+				int count = std::min(PassCapacity, NumParticles - first);
+				if (Mode == EnergyMode::Fused)
+				{
+					ScoreFused(first, count);
+				}
+				else if (Mode == EnergyMode::Compute)
+				{
+					ScoreCompute(first, count);
+				}
+				else
+				{
+					ScoreReductionChain(first, count);
+				}
+			}
+
+			if (readback)
+			{
+				glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+				glCopyNamedBufferSubData(energyBuffer, readbackBuffer, 0, 0, sizeof(float)*NumParticles);
+			}
+		}
+
+		// render, subtract and reduce one atlas of particles through the ping-pong framebuffer chain
+		void ScoreReductionChain(int first, int count)
+		{
+			glEnable(GL_DEPTH_TEST);
+			//Send matricies to shader
+			SetRenderUniforms(RTTShader);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, ping);
+			glViewport(0, 0, AtlasColumns*128, AtlasRows*128);
+			glClear(GL_DEPTH_BUFFER_BIT);
+
+			RTTShader.use();
+			DrawParticles(first, count);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, pong);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			SubtractionShader.use();
+			SubtractionShader.setInt("screenTexture", 0);
+			SubtractionShader.setInt("atlasColumns", AtlasColumns);
+			SubtractionShader.setInt("atlasRows", AtlasRows);
+			SubtractionShader.setInt("gendepTexture", 2);
+			glBindVertexArray(quadVAO);
+			glDrawArrays(GL_TRIANGLES, 0, 6);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, pang);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			R2Shader.use();
+			R2Shader.setInt("tex", 3);
+			R2Shader.setFloat("width", AtlasColumns*128.0f);
+			R2Shader.setFloat("height", AtlasRows*128.0f);
+			glViewport(0, 0, AtlasColumns*128, AtlasRows*128);
+			glDrawArrays(GL_TRIANGLES, 0 , 6);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, pung);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			R2Shader.use();
+			R2Shader.setInt("tex", 4);
+			R2Shader.setFloat("width", AtlasColumns*64.0f);
+			R2Shader.setFloat("height", AtlasRows*64.0f);
+			glViewport(0, 0, AtlasColumns*64, AtlasRows*64);
+			glDrawArrays(GL_TRIANGLES, 0 , 6);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, pling);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			R2Shader.use();
+			R2Shader.setInt("tex", 5);
+			R2Shader.setFloat("width", AtlasColumns*32.0f);
+			R2Shader.setFloat("height", AtlasRows*32.0f);
+			glViewport(0, 0, AtlasColumns*32, AtlasRows*32);
+			glDrawArrays(GL_TRIANGLES, 0 , 6);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, plang);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			R2Shader.use();
+			R2Shader.setInt("tex", 6);
+			R2Shader.setFloat("width", AtlasColumns*16.0f);
+			R2Shader.setFloat("height", AtlasRows*16.0f);
+			glViewport(0, 0, AtlasColumns*16, AtlasRows*16);
+			glDrawArrays(GL_TRIANGLES, 0 , 6);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, plong);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			R2Shader.use();
+			R2Shader.setInt("tex", 7);
+			R2Shader.setFloat("width", AtlasColumns*8.0f);
+			R2Shader.setFloat("height", AtlasRows*8.0f);
+			glViewport(0, 0, AtlasColumns*8, AtlasRows*8);
+			glDrawArrays(GL_TRIANGLES, 0 , 6);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, plung);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			R2Shader.use();
+			R2Shader.setInt("tex", 8);
+			R2Shader.setFloat("width", AtlasColumns*4.0f);
+			R2Shader.setFloat("height", AtlasRows*4.0f);
+			glViewport(0, 0, AtlasColumns*4, AtlasRows*4);
+			glDrawArrays(GL_TRIANGLES, 0 , 6);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, pleng);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			R2Shader.use();
+			R2Shader.setInt("tex", 9);
+			R2Shader.setFloat("width", AtlasColumns*2.0f);
+			R2Shader.setFloat("height", AtlasRows*2.0f);
+			glViewport(0, 0, AtlasColumns*2, AtlasRows*2);
+			glDrawArrays(GL_TRIANGLES, 0 , 6);
+
+			// pack the averages of this atlas into energyBuffer instead of stalling on them here
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, energyBuffer);
+			glGetTextureImage(tex1, 0, GL_DEPTH_COMPONENT, GL_FLOAT, sizeof(float)*PassCapacity, (void*)(first*sizeof(float)));
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+
+		// render depth once, then score only the visible fragments straight into energyBuffer
+		void ScoreFused(int first, int count)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, ping);
+			glViewport(0, 0, TargetWidth, TargetHeight);
+			glClear(GL_DEPTH_BUFFER_BIT);
+
+			// both passes only use the depth buffer, the layered linear depth is left alone
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+			// depth pre-pass, leaves the closest surface of every particle in the depth buffer
+			SetRenderUniforms(RTTDepthShader);
+			DrawParticles(first, count);
+
+			// scoring pass, only fragments that survived the pre-pass accumulate |ref - rendered|
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, energyBuffer);
+			SetRenderUniforms(RTTScoreShader);
+			RTTScoreShader.setInt("refTexture", 0);
+			RTTScoreShader.setInt("firstParticle", first);
+			glDepthFunc(GL_EQUAL);
+			glDepthMask(GL_FALSE);
+			DrawParticles(first, count);
+			glDepthMask(GL_TRUE);
+			glDepthFunc(GL_LESS);
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		}
+
+		// render one pass of particles, then subtract and sum each tile or layer with one compute work group
+		void ScoreCompute(int first, int count)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, ping);
+			glViewport(0, 0, TargetWidth, TargetHeight);
+			ClearTarget();
+			SetRenderUniforms(RTTShader);
+			DrawParticles(first, count);
+
+			// the sampled pixels go through their own shader, it only reads the listed texels of each tile
+			ComputeShader& shader = Samples.Pixels.empty() ? ReductionShader : SampledShader;
+			shader.use();
+			shader.setInt("depthTexture", 2);
+			shader.setInt("refTexture", 0);
+			shader.setInt("tileSize", 128);
+			shader.setInt("atlasColumns", AtlasColumns);
+			shader.setInt("firstParticle", first);
+			shader.setInt("numSamples", Samples.Pixels.size());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, energyBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sampleBuffer);
+			glDispatchCompute(count, 1, 1);
+		}
+
+		// wait for the readback fence of the current generation and copy the energies out of the mapped buffer
+		void CollectEnergies(float* energies)
+		{
+			auto stallStart = std::chrono::high_resolution_clock::now();
+			GLenum status = glClientWaitSync(ReadbackFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			while (status == GL_TIMEOUT_EXPIRED)
+			{
+				status = glClientWaitSync(ReadbackFence, 0, 1000000000);
+			}
+			if (status == GL_WAIT_FAILED)
+			{
+				std::cerr << "WARNING: energy readback fence failed" << std::endl;
+			}
+			glDeleteSync(ReadbackFence);
+			ReadbackFence = 0;
+			auto stallEnd = std::chrono::high_resolution_clock::now();
+			StallTimes.push_back(std::chrono::duration<double, std::micro>(stallEnd - stallStart).count());
+
+			if (Mode == EnergyMode::Fused)
+			{
+				// scores are stored in 16.16 fixed point relative to an empty tile
+				const GLint* scores = static_cast<const GLint*>(ReadbackPtr);
+				for (int p = 0; p < NumParticles; p++)
+				{
+					energies[p] = (BackgroundEnergy + scores[p] / 65536.0f) / (128.0f*128.0f);
+				}
+			}
+			else
+			{
+				const float* averages = static_cast<const float*>(ReadbackPtr);
+				for (int p = 0; p < NumParticles; p++)
+				{
+					energies[p] = averages[p];
+				}
+			}
 		}
 };
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstdint>
+
+#include "simd.h"
+
+// Seeded random stream of eight interleaved xoshiro128+ generators. Every (seed, stream) pair gives its own
+// reproducible sequence, so each swarm and each worker thread can draw from an independent stream without sharing
+// state. The eight lanes are stepped together, with AVX2 when the CPU has it, and produce the same numbers either way.
+class RandomStream
+{
+	private:
+		static const int Lanes = 8;
+
+		alignas(32) uint32_t state[4][Lanes];
+		// outputs of the last step not handed out yet
+		alignas(32) uint32_t buffer[Lanes];
+		int buffered;
+
+		static uint64_t SplitMix64(uint64_t& x)
+		{
+			uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+			z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27))*0x94D049BB133111EBull;
+			return z ^ (z >> 31);
+		}
+
+		static uint32_t Rotl(uint32_t x, int k)
+		{
+			return (x << k) | (x >> (32 - k));
+		}
+
+		// one step of every lane, out gets the eight outputs
+		static void StepScalar(uint32_t (*s)[Lanes], uint32_t* out)
+		{
+			for (int lane = 0; lane < Lanes; lane++)
+			{
+				out[lane] = s[0][lane] + s[3][lane];
+				uint32_t t = s[1][lane] << 9;
+				s[2][lane] ^= s[0][lane];
+				s[3][lane] ^= s[1][lane];
+				s[1][lane] ^= s[2][lane];
+				s[0][lane] ^= s[3][lane];
+				s[2][lane] ^= t;
+				s[3][lane] = Rotl(s[3][lane], 11);
+			}
+		}
+
+#ifdef SIMD_X86
+		// count uniforms in [0, 1), count a multiple of Lanes
+		__attribute__((target("avx2")))
+		static void FillAVX2(uint32_t (*s)[Lanes], float* out, int count)
+		{
+			__m256i s0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[0]));
+			__m256i s1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[1]));
+			__m256i s2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[2]));
+			__m256i s3 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[3]));
+			const __m256 scale = _mm256_set1_ps(1.0f / 16777216.0f);
+			for (int i = 0; i < count; i += Lanes)
+			{
+				__m256i result = _mm256_add_epi32(s0, s3);
+				__m256i t = _mm256_slli_epi32(s1, 9);
+				s2 = _mm256_xor_si256(s2, s0);
+				s3 = _mm256_xor_si256(s3, s1);
+				s1 = _mm256_xor_si256(s1, s2);
+				s0 = _mm256_xor_si256(s0, s3);
+				s2 = _mm256_xor_si256(s2, t);
+				s3 = _mm256_or_si256(_mm256_slli_epi32(s3, 11), _mm256_srli_epi32(s3, 21));
+				// the top 24 bits fit a float exactly
+				_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(result, 8)), scale));
+			}
+			_mm256_store_si256(reinterpret_cast<__m256i*>(s[0]), s0);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(s[1]), s1);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(s[2]), s2);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(s[3]), s3);
+		}
+#endif
+
+		static void FillScalar(uint32_t (*s)[Lanes], float* out, int count)
+		{
+			uint32_t values[Lanes];
+			for (int i = 0; i < count; i += Lanes)
+			{
+				StepScalar(s, values);
+				for (int lane = 0; lane < Lanes; lane++)
+				{
+					out[i + lane] = (values[lane] >> 8)*(1.0f / 16777216.0f);
+				}
+			}
+		}
+
+	public:
+		RandomStream(uint64_t seed=0, uint64_t stream=0)
+		{
+			Seed(seed, stream);
+		}
+
+		// restart the sequence of a (seed, stream) pair
+		void Seed(uint64_t seed, uint64_t stream=0)
+		{
+			// the stream is folded in through its own SplitMix64 step, so nearby seeds and streams do not overlap
+			uint64_t mix = seed;
+			uint64_t streamMix = stream;
+			mix ^= SplitMix64(streamMix);
+			for (int lane = 0; lane < Lanes; lane++)
+			{
+				uint64_t a = SplitMix64(mix);
+				uint64_t b = SplitMix64(mix);
+				state[0][lane] = (uint32_t) a;
+				state[1][lane] = (uint32_t) (a >> 32);
+				state[2][lane] = (uint32_t) b;
+				state[3][lane] = (uint32_t) (b >> 32);
+				// xoshiro must not start from all zeros
+				if (!(a | b))
+				{
+					state[0][lane] = 1;
+				}
+			}
+			buffered = 0;
+		}
+
+		uint32_t Next()
+		{
+			if (buffered == 0)
+			{
+				StepScalar(state, buffer);
+				buffered = Lanes;
+			}
+			return buffer[Lanes - buffered--];
+		}
+
+		// uniform in [0, 1)
+		float Uniform()
+		{
+			return (Next() >> 8)*(1.0f / 16777216.0f);
+		}
+
+		// uniform in [min, max)
+		float Uniform(float min, float max)
+		{
+			return min + (max - min)*Uniform();
+		}
+
+		// count uniforms in [0, 1), the same numbers as count calls to Uniform()
+		void Fill(float* out, int count)
+		{
+			int i = 0;
+			for (; i < count && buffered > 0; i++)
+			{
+				out[i] = Uniform();
+			}
+			int bulk = (count - i) / Lanes*Lanes;
+#ifdef SIMD_X86
+			static const bool avx2 = GetCPUFeatures().AVX2;
+			if (avx2)
+			{
+				FillAVX2(state, out + i, bulk);
+			}
+			else
+#endif
+			{
+				FillScalar(state, out + i, bulk);
+			}
+			for (i += bulk; i < count; i++)
+			{
+				out[i] = Uniform();
+			}
+		}
+};
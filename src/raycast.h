@@ -0,0 +1,337 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "pose.h"
+#include "SkeletonMesh.h"
+
+// pixel of a 128x128 tile, row 0 at the bottom like the rendered depth
+struct PixelCoord
+{
+	uint16_t X;
+	uint16_t Y;
+};
+
+// Sparse CPU energy, casts one ray per requested pixel against the skinned foot. The BVH is built once over the mesh
+// topology and only its bounds are refit for every pose. Depths match the linear depth the renderers write: the
+// distance along the view axis of the closest hit between the near and far planes, 1.0 for a miss.
+class RayCaster
+{
+	private:
+		struct BVHNode
+		{
+			glm::vec3 Min;
+			glm::vec3 Max;
+			// children are Left and Left + 1 for inner nodes, leaves cover Count triangles from First
+			int Left;
+			int First;
+			int Count;
+		};
+
+		static const int LeafSize = 4;
+
+		std::vector<glm::vec4> positions;
+		std::vector<glm::vec4> boneWeights;
+		std::vector<unsigned int> indices;
+		glm::mat4 MeshToBoneToe, MeshToBoneLeg, BoneToMeshToe, BoneToMeshLeg;
+		float ZNear, ZFar;
+		float TanHalfFov;
+		// triangles in BVH order, the skinned eye space vertices of the current pose and the tree over them
+		std::vector<int> triangles;
+		std::vector<glm::vec3> eyeVertices;
+		std::vector<BVHNode> nodes;
+
+		void TriangleBounds(int triangle, glm::vec3& min, glm::vec3& max) const
+		{
+			const glm::vec3& a = eyeVertices[indices[3*triangle]];
+			const glm::vec3& b = eyeVertices[indices[3*triangle + 1]];
+			const glm::vec3& c = eyeVertices[indices[3*triangle + 2]];
+			min = glm::vec3(std::min(a.x, std::min(b.x, c.x)), std::min(a.y, std::min(b.y, c.y)), std::min(a.z, std::min(b.z, c.z)));
+			max = glm::vec3(std::max(a.x, std::max(b.x, c.x)), std::max(a.y, std::max(b.y, c.y)), std::max(a.z, std::max(b.z, c.z)));
+		}
+
+		// median split along the longest axis of the centroids, children always come after their parent
+		void Build(int nodeIndex, int first, int count)
+		{
+			nodes[nodeIndex].First = first;
+			nodes[nodeIndex].Count = count;
+			nodes[nodeIndex].Left = -1;
+			if (count <= LeafSize)
+			{
+				return;
+			}
+
+			glm::vec3 min(std::numeric_limits<float>::max());
+			glm::vec3 max(-std::numeric_limits<float>::max());
+			for (int t = first; t < first + count; t++)
+			{
+				glm::vec3 centroid = Centroid(triangles[t]);
+				min = glm::vec3(std::min(min.x, centroid.x), std::min(min.y, centroid.y), std::min(min.z, centroid.z));
+				max = glm::vec3(std::max(max.x, centroid.x), std::max(max.y, centroid.y), std::max(max.z, centroid.z));
+			}
+			glm::vec3 extent = max - min;
+			int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+			int half = count / 2;
+			std::nth_element(triangles.begin() + first, triangles.begin() + first + half, triangles.begin() + first + count, [&](int a, int b) {
+				return Centroid(a)[axis] < Centroid(b)[axis];
+			});
+
+			int left = nodes.size();
+			nodes[nodeIndex].Left = left;
+			nodes.push_back(BVHNode());
+			nodes.push_back(BVHNode());
+			Build(left, first, half);
+			Build(left + 1, first + half, count - half);
+		}
+
+		glm::vec3 Centroid(int triangle) const
+		{
+			return (eyeVertices[indices[3*triangle]] + eyeVertices[indices[3*triangle + 1]] + eyeVertices[indices[3*triangle + 2]]) / 3.0f;
+		}
+
+		// bounds of every node from the current vertices, children first
+		void Refit()
+		{
+			for (int n = (int) nodes.size() - 1; n >= 0; n--)
+			{
+				BVHNode& node = nodes[n];
+				if (node.Left < 0)
+				{
+					TriangleBounds(triangles[node.First], node.Min, node.Max);
+					for (int t = node.First + 1; t < node.First + node.Count; t++)
+					{
+						glm::vec3 min, max;
+						TriangleBounds(triangles[t], min, max);
+						node.Min = glm::vec3(std::min(node.Min.x, min.x), std::min(node.Min.y, min.y), std::min(node.Min.z, min.z));
+						node.Max = glm::vec3(std::max(node.Max.x, max.x), std::max(node.Max.y, max.y), std::max(node.Max.z, max.z));
+					}
+				}
+				else
+				{
+					const BVHNode& a = nodes[node.Left];
+					const BVHNode& b = nodes[node.Left + 1];
+					node.Min = glm::vec3(std::min(a.Min.x, b.Min.x), std::min(a.Min.y, b.Min.y), std::min(a.Min.z, b.Min.z));
+					node.Max = glm::vec3(std::max(a.Max.x, b.Max.x), std::max(a.Max.y, b.Max.y), std::max(a.Max.z, b.Max.z));
+				}
+			}
+		}
+
+		// slab test, the entry distance or infinity when the box is missed within [tMin, tMax]
+		static float IntersectBox(const BVHNode& node, const glm::vec3& invDir, float tMin, float tMax)
+		{
+			// the ray starts at the eye, so the slabs are measured from the origin
+			for (int axis = 0; axis < 3; axis++)
+			{
+				float t0 = node.Min[axis]*invDir[axis];
+				float t1 = node.Max[axis]*invDir[axis];
+				if (t0 > t1)
+				{
+					std::swap(t0, t1);
+				}
+				tMin = std::max(tMin, t0);
+				tMax = std::min(tMax, t1);
+				if (tMin > tMax)
+				{
+					return std::numeric_limits<float>::infinity();
+				}
+			}
+			return tMin;
+		}
+
+		// Moller-Trumbore from the eye, both windings count like the GL path with culling off. A closer hit sets u and v,
+		// the barycentrics of the second and third corner.
+		float IntersectTriangle(int triangle, const glm::vec3& dir, float tMin, float tMax, float& hitU, float& hitV) const
+		{
+			const glm::vec3& a = eyeVertices[indices[3*triangle]];
+			const glm::vec3& b = eyeVertices[indices[3*triangle + 1]];
+			const glm::vec3& c = eyeVertices[indices[3*triangle + 2]];
+			glm::vec3 edge1 = b - a;
+			glm::vec3 edge2 = c - a;
+			glm::vec3 p = glm::cross(dir, edge2);
+			float det = glm::dot(edge1, p);
+			if (std::abs(det) < 1e-12f)
+			{
+				return tMax;
+			}
+			float invDet = 1.0f / det;
+			glm::vec3 s = -a;
+			float u = glm::dot(s, p)*invDet;
+			if (u < 0.0f || u > 1.0f)
+			{
+				return tMax;
+			}
+			glm::vec3 q = glm::cross(s, edge1);
+			float v = glm::dot(dir, q)*invDet;
+			if (v < 0.0f || u + v > 1.0f)
+			{
+				return tMax;
+			}
+			float t = glm::dot(edge2, q)*invDet;
+			if (t >= tMin && t < tMax)
+			{
+				hitU = u;
+				hitV = v;
+				return t;
+			}
+			return tMax;
+		}
+
+		// closest hit along the ray through a pixel center between the near and far planes, triangle is -1 for a miss
+		float Trace(PixelCoord pixel, int& triangle, float& u, float& v) const
+		{
+			// the view axis component of the direction is -1, so the hit distance is the linear depth
+			float ndcX = (pixel.X + 0.5f) / 64.0f - 1.0f;
+			float ndcY = (pixel.Y + 0.5f) / 64.0f - 1.0f;
+			glm::vec3 dir(ndcX*TanHalfFov, ndcY*TanHalfFov, -1.0f);
+			glm::vec3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+
+			float closest = ZFar;
+			triangle = -1;
+			int stack[64];
+			int top = 0;
+			stack[top++] = 0;
+			while (top > 0)
+			{
+				const BVHNode& node = nodes[stack[--top]];
+				if (IntersectBox(node, invDir, ZNear, closest) >= closest)
+				{
+					continue;
+				}
+				if (node.Left < 0)
+				{
+					for (int t = node.First; t < node.First + node.Count; t++)
+					{
+						float hit = IntersectTriangle(triangles[t], dir, ZNear, closest, u, v);
+						if (hit < closest)
+						{
+							closest = hit;
+							triangle = triangles[t];
+						}
+					}
+				}
+				else
+				{
+					stack[top++] = node.Left;
+					stack[top++] = node.Left + 1;
+				}
+			}
+			return closest;
+		}
+
+	public:
+		RayCaster() : ZNear{0.05f}, ZFar{1.0f}, TanHalfFov{0.0f} {}
+
+		// copies the mesh data and builds the tree over its rest pose
+		RayCaster(const SkeletonMesh& mesh, float zNear=0.05f, float zFar=1.0f) : ZNear{zNear}, ZFar{zFar}
+		{
+			TanHalfFov = std::tan(glm::radians(42.0f) / 2.0f);
+			for (const Vertex& vertex : mesh.vertices)
+			{
+				positions.push_back(glm::vec4(vertex.Position, 1.0f));
+			}
+			for (const VertexBoneData& weights : mesh.vbd)
+			{
+				boneWeights.push_back(weights.weights);
+			}
+			indices = mesh.indices;
+			MeshToBoneLeg = mesh.offsetMatricies[0];
+			MeshToBoneToe = mesh.offsetMatricies[2];
+			BoneToMeshLeg = glm::inverse(MeshToBoneLeg);
+			BoneToMeshToe = glm::inverse(MeshToBoneToe);
+
+			eyeVertices.resize(positions.size());
+			for (size_t v = 0; v < positions.size(); v++)
+			{
+				eyeVertices[v] = glm::vec3(positions[v]);
+			}
+			int numTriangles = indices.size() / 3;
+			triangles.resize(numTriangles);
+			for (int t = 0; t < numTriangles; t++)
+			{
+				triangles[t] = t;
+			}
+			nodes.reserve(2*numTriangles);
+			nodes.push_back(BVHNode());
+			Build(0, 0, numTriangles);
+			Refit();
+		}
+
+		// skin the mesh into eye space with the RTTVShader.glsl math and refit the tree, the topology is kept
+		void SetPose(const PoseParameters& pose)
+		{
+			glm::mat4 model, toeRotation, legRotation;
+			ComputePoseMatrices(pose, model, toeRotation, legRotation);
+			glm::mat4 toe = BoneToMeshToe*toeRotation*MeshToBoneToe;
+			glm::mat4 leg = BoneToMeshLeg*legRotation*MeshToBoneLeg;
+			for (size_t v = 0; v < positions.size(); v++)
+			{
+				const glm::vec4& weights = boneWeights[v];
+				glm::vec4 skinned = weights.z*(toe*positions[v]) + weights.x*(leg*positions[v]) + (weights.y + weights.w)*positions[v];
+				eyeVertices[v] = glm::vec3(model*skinned);
+			}
+			Refit();
+		}
+
+		// linear depth at one pixel of the current pose
+		float Depth(PixelCoord pixel) const
+		{
+			int triangle;
+			float u, v;
+			float depth = Trace(pixel, triangle, u, v);
+			return triangle >= 0 ? depth : 1.0f;
+		}
+
+		// the pixel as the triangle ID target stores it: triangle or -1, the barycentrics of the second and third corner
+		// and the linear depth
+		void Identify(PixelCoord pixel, float* texel) const
+		{
+			int triangle;
+			float u = 0.0f, v = 0.0f;
+			float depth = Trace(pixel, triangle, u, v);
+			texel[0] = (float) triangle;
+			texel[1] = triangle >= 0 ? u : 0.0f;
+			texel[2] = triangle >= 0 ? v : 0.0f;
+			texel[3] = triangle >= 0 ? depth : 1.0f;
+		}
+
+		// mean |ref - rendered| over the pixels, the reference is sampled upside down like the subtraction pass
+		float Energy(const PixelCoord* pixels, int count, const float* refImg) const
+		{
+			if (count <= 0)
+			{
+				return 0.0f;
+			}
+			float energy = 0.0f;
+			for (int i = 0; i < count; i++)
+			{
+				energy += std::abs(refImg[(127 - pixels[i].Y)*128 + pixels[i].X] - Depth(pixels[i]));
+			}
+			return energy / count;
+		}
+
+		// weighted sum of |ref - rendered| over the pixels, with StratifiedSamples weights this estimates the mean over the
+		// tile. Casting stops once the sum is above bound, skipped gets the number of pixels left uncast.
+		float Energy(const PixelCoord* pixels, const float* weights, int count, const float* refImg, float bound, int& skipped) const
+		{
+			float energy = 0.0f;
+			skipped = 0;
+			for (int i = 0; i < count; i++)
+			{
+				energy += weights[i]*std::abs(refImg[(127 - pixels[i].Y)*128 + pixels[i].X] - Depth(pixels[i]));
+				if (energy > bound)
+				{
+					skipped = count - i - 1;
+					break;
+				}
+			}
+			return energy;
+		}
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "raycast.h"
+
+// Pixels a sparse energy is evaluated at, with the weights that turn the weighted sum of |ref - rendered| over them
+// into an estimate of the mean over the whole 128x128 tile
+struct SampleSet
+{
+	std::vector<PixelCoord> Pixels;
+	std::vector<float> Weights;
+};
+
+// importance of rendered pixel (x, y), the reference is sampled upside down like the subtraction pass
+inline float SampleImportance(const float* refImg, int x, int y, float silhouetteWeight, float boundaryWeight)
+{
+	bool foreground = refImg[(127 - y)*128 + x] < 1.0f;
+	const int offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+	for (int n = 0; n < 4; n++)
+	{
+		int nx = x + offsets[n][0];
+		int ny = y + offsets[n][1];
+		if (nx >= 0 && nx < 128 && ny >= 0 && ny < 128 && (refImg[(127 - ny)*128 + nx] < 1.0f) != foreground)
+		{
+			return boundaryWeight;
+		}
+	}
+	return foreground ? silhouetteWeight : 1.0f;
+}
+
+// Stratified subset of about numSamples pixels, drawn once per reference frame. Every pixel gets an importance from
+// the reference: 1 for background, silhouetteWeight inside the foot and boundaryWeight on its outline. Pixels are
+// visited in 16x16 blocks and picked by systematic sampling of the cumulative importance, which spreads the samples
+// over the blocks in proportion to their importance. Each pick is weighted by the inverse of its selection rate, so
+// the estimate stays unbiased however the importance is skewed. samples is overwritten and keeps its capacity, so
+// refilling it every frame stops allocating once it has held numSamples pixels.
+inline void StratifiedSamples(const float* refImg, int numSamples, SampleSet& samples, float silhouetteWeight=4.0f, float boundaryWeight=16.0f)
+{
+	samples.Pixels.clear();
+	samples.Weights.clear();
+	if (numSamples <= 0)
+	{
+		return;
+	}
+	samples.Pixels.reserve(numSamples);
+	samples.Weights.reserve(numSamples);
+
+	float total = 0.0f;
+	for (int y = 0; y < 128; y++)
+	{
+		for (int x = 0; x < 128; x++)
+		{
+			total += SampleImportance(refImg, x, y, silhouetteWeight, boundaryWeight);
+		}
+	}
+
+	// one pick every step of cumulative importance, starting half a step in
+	float step = total / numSamples;
+	float next = 0.5f*step;
+	float cumulative = 0.0f;
+	for (int block = 0; block < 64; block++)
+	{
+		int blockX = 16*(block % 8);
+		int blockY = 16*(block / 8);
+		for (int y = blockY; y < blockY + 16; y++)
+		{
+			for (int x = blockX; x < blockX + 16; x++)
+			{
+				float weight = SampleImportance(refImg, x, y, silhouetteWeight, boundaryWeight);
+				cumulative += weight;
+				int hits = 0;
+				while (next < cumulative)
+				{
+					hits++;
+					next += step;
+				}
+				if (hits > 0)
+				{
+					PixelCoord pixel = {(uint16_t) x, (uint16_t) y};
+					samples.Pixels.push_back(pixel);
+					// selected at a rate of weight / step, scaled to the mean over the tile
+					samples.Weights.push_back(hits*step / (weight*128.0f*128.0f));
+				}
+			}
+		}
+	}
+}
+
+inline SampleSet StratifiedSamples(const float* refImg, int numSamples, float silhouetteWeight=4.0f, float boundaryWeight=16.0f)
+{
+	SampleSet samples;
+	StratifiedSamples(refImg, numSamples, samples, silhouetteWeight, boundaryWeight);
+	return samples;
+}
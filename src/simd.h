@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+// Instruction sets the CPU scoring kernels can use, detected once at runtime
+struct CPUFeatures
+{
+	bool AVX2;
+	bool AVX512;
+};
+
+inline const CPUFeatures& GetCPUFeatures()
+{
+	static const CPUFeatures features = [] {
+		CPUFeatures detected = {false, false};
+#ifdef SIMD_X86
+		__builtin_cpu_init();
+		detected.AVX2 = __builtin_cpu_supports("avx2");
+		detected.AVX512 = __builtin_cpu_supports("avx512f");
+#endif
+		return detected;
+	}();
+	return features;
+}
+
+typedef float (*AbsDiffSumKernel)(const float*, const float*, int);
+
+inline float AbsDiffSumScalar(const float* a, const float* b, int n)
+{
+	float sum = 0.0f;
+	for (int i = 0; i < n; i++)
+	{
+		sum += std::abs(a[i] - b[i]);
+	}
+	return sum;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2")))
+inline float AbsDiffSumAVX2(const float* a, const float* b, int n)
+{
+	// clearing the sign bit is the absolute value
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		__m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+		sum0 = _mm256_add_ps(sum0, _mm256_andnot_ps(signMask, d0));
+		sum1 = _mm256_add_ps(sum1, _mm256_andnot_ps(signMask, d1));
+	}
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		sum0 = _mm256_add_ps(sum0, _mm256_andnot_ps(signMask, d));
+	}
+	__m256 sum = _mm256_add_ps(sum0, sum1);
+	__m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+	half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+	return _mm_cvtss_f32(half) + AbsDiffSumScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline float AbsDiffSumAVX512(const float* a, const float* b, int n)
+{
+	__m512 sum0 = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	int i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		__m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+		__m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+		sum0 = _mm512_add_ps(sum0, _mm512_abs_ps(d0));
+		sum1 = _mm512_add_ps(sum1, _mm512_abs_ps(d1));
+	}
+	// the remainder goes through masked loads, masked out lanes are zero in both inputs
+	for (; i < n; i += 16)
+	{
+		__mmask16 mask = n - i >= 16 ? (__mmask16) 0xFFFF : (__mmask16) ((1u << (n - i)) - 1u);
+		__m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+		sum0 = _mm512_add_ps(sum0, _mm512_abs_ps(d));
+	}
+	alignas(64) float lanes[16];
+	_mm512_store_ps(lanes, _mm512_add_ps(sum0, sum1));
+	float sum = 0.0f;
+	for (int lane = 0; lane < 16; lane++)
+	{
+		sum += lanes[lane];
+	}
+	return sum;
+}
+#endif
+
+#ifdef SIMD_X86
+// Sine and cosine of eight floats, Cephes style: reduce by multiples of pi/4 in three steps, evaluate both minimax
+// polynomials on [-pi/4, pi/4] and pick and sign them by octant. Accurate to a few ulp for the angles of a pose.
+__attribute__((target("avx2")))
+inline void SinCosAVX2(__m256 x, __m256& sinX, __m256& cosX)
+{
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	__m256 sinSign = _mm256_and_ps(x, signMask);
+	x = _mm256_andnot_ps(signMask, x);
+
+	// octant rounded up to even, so the reduced angle lands in [-pi/4, pi/4]
+	__m256i octant = _mm256_cvttps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(1.27323954473516f)));
+	octant = _mm256_and_si256(_mm256_add_epi32(octant, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+	__m256 y = _mm256_cvtepi32_ps(octant);
+	x = _mm256_sub_ps(x, _mm256_mul_ps(y, _mm256_set1_ps(0.78515625f)));
+	x = _mm256_sub_ps(x, _mm256_mul_ps(y, _mm256_set1_ps(2.4187564849853515625e-4f)));
+	x = _mm256_sub_ps(x, _mm256_mul_ps(y, _mm256_set1_ps(3.77489497744594108e-8f)));
+
+	// octants 2 and 6 swap the polynomials, octants 4 and 6 flip the sine and 2 and 4 the cosine
+	__m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(octant, _mm256_set1_epi32(2)), _mm256_setzero_si256()));
+	sinSign = _mm256_xor_ps(sinSign, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(octant, _mm256_set1_epi32(4)), 29)));
+	__m256 cosSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_andnot_si256(_mm256_sub_epi32(octant, _mm256_set1_epi32(2)), _mm256_set1_epi32(4)), 29));
+
+	__m256 z = _mm256_mul_ps(x, x);
+	__m256 cosPoly = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.443315711809948e-5f), z), _mm256_set1_ps(-1.388731625493765e-3f));
+	cosPoly = _mm256_add_ps(_mm256_mul_ps(cosPoly, z), _mm256_set1_ps(4.166664568298827e-2f));
+	cosPoly = _mm256_mul_ps(_mm256_mul_ps(cosPoly, z), z);
+	cosPoly = _mm256_add_ps(_mm256_sub_ps(cosPoly, _mm256_mul_ps(z, _mm256_set1_ps(0.5f))), _mm256_set1_ps(1.0f));
+	__m256 sinPoly = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(-1.9515295891e-4f), z), _mm256_set1_ps(8.3321608736e-3f));
+	sinPoly = _mm256_add_ps(_mm256_mul_ps(sinPoly, z), _mm256_set1_ps(-1.6666654611e-1f));
+	sinPoly = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(sinPoly, z), x), x);
+
+	sinX = _mm256_xor_ps(_mm256_blendv_ps(cosPoly, sinPoly, swap), sinSign);
+	cosX = _mm256_xor_ps(_mm256_blendv_ps(sinPoly, cosPoly, swap), cosSign);
+}
+#endif
+
+// widest kernel the CPU supports
+inline AbsDiffSumKernel SelectAbsDiffSum()
+{
+#ifdef SIMD_X86
+	if (GetCPUFeatures().AVX512)
+	{
+		return AbsDiffSumAVX512;
+	}
+	if (GetCPUFeatures().AVX2)
+	{
+		return AbsDiffSumAVX2;
+	}
+#endif
+	return AbsDiffSumScalar;
+}
+
+// Sum of |a - b| over n floats
+inline float AbsDiffSum(const float* a, const float* b, int n)
+{
+	static const AbsDiffSumKernel kernel = SelectAbsDiffSum();
+	return kernel(a, b, n);
+}
+
+// Sum of |ref - image| for every image of a batch. The reference is swept in blocks that stay in L1 and every image
+// is scored against a block before moving on, so the reference comes from memory once for the whole batch.
+inline void BatchEnergies(const float* ref, const float* const* images, int numImages, int imageSize, float* energies)
+{
+	static const AbsDiffSumKernel kernel = SelectAbsDiffSum();
+	const int blockSize = 2048;
+	std::fill(energies, energies + numImages, 0.0f);
+	for (int start = 0; start < imageSize; start += blockSize)
+	{
+		int count = std::min(blockSize, imageSize - start);
+		for (int i = 0; i < numImages; i++)
+		{
+			energies[i] += kernel(ref + start, images[i] + start, count);
+		}
+	}
+}
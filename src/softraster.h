@@ -0,0 +1,318 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pose.h"
+#include "simd.h"
+#include "SkeletonMesh.h"
+#include "threadpool.h"
+
+// Rows of a rendered tile ordered by how many reference pixels of the foot they hold, the rows that usually carry
+// most of the energy come first. Ties keep the row order, without the buffer std::stable_sort would allocate.
+inline void SilhouetteRowOrder(const float* refImg, std::vector<int>& order)
+{
+	int foreground[128] = {};
+	for (int y = 0; y < 128; y++)
+	{
+		// rendered row y is scored against reference row 127 - y
+		const float* refRow = refImg + (127 - y)*128;
+		for (int x = 0; x < 128; x++)
+		{
+			foreground[y] += refRow[x] < 1.0f;
+		}
+	}
+	order.resize(128);
+	for (int y = 0; y < 128; y++)
+	{
+		order[y] = y;
+	}
+	std::sort(order.begin(), order.end(), [&](int a, int b) { return foreground[a] > foreground[b] || (foreground[a] == foreground[b] && a < b); });
+}
+
+inline std::vector<int> SilhouetteRowOrder(const float* refImg)
+{
+	std::vector<int> order;
+	SilhouetteRowOrder(refImg, order);
+	return order;
+}
+
+// CPU version of the particle render and energy for nodes without OpenGL. The foot is skinned with the same math as
+// RTTVShader.glsl, its linear depth is rasterized into a 128x128 tile like RTTFShader.glsl writes it, and the tile is
+// scored against the reference sampled upside down like SubtractionFragmentShader.glsl.
+class SoftwareRasterizer
+{
+	private:
+		std::vector<glm::vec4> positions;
+		std::vector<glm::vec4> boneWeights;
+		std::vector<unsigned int> indices;
+		glm::mat4 MeshToBoneToe, MeshToBoneLeg, BoneToMeshToe, BoneToMeshLeg;
+		glm::mat4 ProjMat;
+		float ZNear, ZFar;
+
+		// per thread buffers of the render and the energies, sized on first use
+		struct Scratch
+		{
+			std::vector<glm::vec4> Window;
+			std::vector<float> Depth;
+		};
+
+		Scratch& ThreadScratch() const
+		{
+			thread_local Scratch scratch;
+			if (scratch.Window.size() < positions.size())
+			{
+				scratch.Window.resize(positions.size());
+			}
+			scratch.Depth.resize(128*128);
+			return scratch;
+		}
+
+		// one triangle in window coordinates, (x, y) in pixels and z in NDC
+		void RasterizeTriangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, float* depth) const
+		{
+			float area = (v1.x - v0.x)*(v2.y - v0.y) - (v1.y - v0.y)*(v2.x - v0.x);
+			if (area == 0.0f)
+			{
+				return;
+			}
+			// culling is off in the GL path, so both windings are drawn
+			if (area < 0.0f)
+			{
+				std::swap(v1, v2);
+				area = -area;
+			}
+
+			int minX = std::max(0, (int) std::floor(std::min(v0.x, std::min(v1.x, v2.x))));
+			int maxX = std::min(127, (int) std::ceil(std::max(v0.x, std::max(v1.x, v2.x))));
+			int minY = std::max(0, (int) std::floor(std::min(v0.y, std::min(v1.y, v2.y))));
+			int maxY = std::min(127, (int) std::ceil(std::max(v0.y, std::max(v1.y, v2.y))));
+			if (minX > maxX || minY > maxY)
+			{
+				return;
+			}
+			// whole groups of four, the tile width is a multiple of four and the edge test rejects the extra pixels
+			minX &= ~3;
+
+			// edge functions of the edges opposite v0, v1 and v2, each one steps linearly across the tile
+			glm::vec3 a[3] = {v1, v2, v0};
+			glm::vec3 b[3] = {v2, v0, v1};
+			float stepX[3], stepY[3], origin[3];
+			bool topLeft[3];
+			float px = minX + 0.5f;
+			float py = minY + 0.5f;
+			for (int e = 0; e < 3; e++)
+			{
+				float dx = b[e].x - a[e].x;
+				float dy = b[e].y - a[e].y;
+				stepX[e] = -dy;
+				stepY[e] = dx;
+				origin[e] = dx*(py - a[e].y) - dy*(px - a[e].x);
+				// pixel centers exactly on an edge belong to top and left edges only, as in GL
+				topLeft[e] = dy < 0.0f || (dy == 0.0f && dx < 0.0f);
+			}
+
+			// z in NDC is affine in window space, so interpolate it with the normalized edge functions
+			float invArea = 1.0f / area;
+			float zStepX = (stepX[0]*v0.z + stepX[1]*v1.z + stepX[2]*v2.z)*invArea;
+			float zStepY = (stepY[0]*v0.z + stepY[1]*v1.z + stepY[2]*v2.z)*invArea;
+			float zOrigin = (origin[0]*v0.z + origin[1]*v1.z + origin[2]*v2.z)*invArea;
+
+			for (int y = minY; y <= maxY; y++)
+			{
+				int row = y - minY;
+				float e0 = origin[0] + row*stepY[0];
+				float e1 = origin[1] + row*stepY[1];
+				float e2 = origin[2] + row*stepY[2];
+				float z = zOrigin + row*zStepY;
+				float* depthRow = depth + y*128;
+				int x = minX;
+#ifdef __SSE2__
+				const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+				const __m128 zero = _mm_setzero_ps();
+				const __m128 one = _mm_set1_ps(1.0f);
+				const __m128 minusOne = _mm_set1_ps(-1.0f);
+				const __m128 numerator = _mm_set1_ps(2.0f*ZNear*ZFar);
+				const __m128 sum = _mm_set1_ps(ZFar + ZNear);
+				const __m128 range = _mm_set1_ps(ZFar - ZNear);
+				__m128 edge[3], edgeStep[3], edgeTie[3];
+				for (int e = 0; e < 3; e++)
+				{
+					float value = e == 0 ? e0 : e == 1 ? e1 : e2;
+					edge[e] = _mm_add_ps(_mm_set1_ps(value), _mm_mul_ps(lane, _mm_set1_ps(stepX[e])));
+					edgeStep[e] = _mm_set1_ps(4.0f*stepX[e]);
+					edgeTie[e] = topLeft[e] ? _mm_castsi128_ps(_mm_set1_epi32(-1)) : zero;
+				}
+				__m128 zs = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(lane, _mm_set1_ps(zStepX)));
+				__m128 zsStep = _mm_set1_ps(4.0f*zStepX);
+				for (; x <= maxX; x += 4)
+				{
+					__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+					for (int e = 0; e < 3; e++)
+					{
+						__m128 covered = _mm_or_ps(_mm_cmpgt_ps(edge[e], zero), _mm_and_ps(_mm_cmpeq_ps(edge[e], zero), edgeTie[e]));
+						inside = _mm_and_ps(inside, covered);
+						edge[e] = _mm_add_ps(edge[e], edgeStep[e]);
+					}
+					// fragments outside the near and far planes are clipped
+					inside = _mm_and_ps(inside, _mm_and_ps(_mm_cmpge_ps(zs, minusOne), _mm_cmple_ps(zs, one)));
+					if (_mm_movemask_ps(inside))
+					{
+						__m128 linear = _mm_div_ps(numerator, _mm_sub_ps(sum, _mm_mul_ps(zs, range)));
+						__m128 stored = _mm_loadu_ps(depthRow + x);
+						__m128 closer = _mm_and_ps(inside, _mm_cmplt_ps(linear, stored));
+						_mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(closer, linear), _mm_andnot_ps(closer, stored)));
+					}
+					zs = _mm_add_ps(zs, zsStep);
+				}
+#else
+				for (; x <= maxX; x++)
+				{
+					int column = x - minX;
+					float f0 = e0 + column*stepX[0];
+					float f1 = e1 + column*stepX[1];
+					float f2 = e2 + column*stepX[2];
+					bool inside = (f0 > 0.0f || (f0 == 0.0f && topLeft[0])) && (f1 > 0.0f || (f1 == 0.0f && topLeft[1])) && (f2 > 0.0f || (f2 == 0.0f && topLeft[2]));
+					float zPixel = z + column*zStepX;
+					if (inside && zPixel >= -1.0f && zPixel <= 1.0f)
+					{
+						float linear = 2.0f*ZNear*ZFar / (ZFar + ZNear - zPixel*(ZFar - ZNear));
+						depthRow[x] = std::min(depthRow[x], linear);
+					}
+				}
+#endif
+			}
+		}
+
+	public:
+		SoftwareRasterizer() : ZNear{0.05f}, ZFar{1.0f} {}
+
+		// copies the mesh data, so a model loaded without GPU upload is enough
+		SoftwareRasterizer(const SkeletonMesh& mesh, float zNear=0.05f, float zFar=1.0f) : ZNear{zNear}, ZFar{zFar}
+		{
+			positions.reserve(mesh.vertices.size());
+			for (const Vertex& vertex : mesh.vertices)
+			{
+				positions.push_back(glm::vec4(vertex.Position, 1.0f));
+			}
+			boneWeights.reserve(mesh.vbd.size());
+			for (const VertexBoneData& weights : mesh.vbd)
+			{
+				boneWeights.push_back(weights.weights);
+			}
+			indices = mesh.indices;
+			MeshToBoneLeg = mesh.offsetMatricies[0];
+			MeshToBoneToe = mesh.offsetMatricies[2];
+			BoneToMeshLeg = glm::inverse(MeshToBoneLeg);
+			BoneToMeshToe = glm::inverse(MeshToBoneToe);
+			ProjMat = glm::perspective(glm::radians(42.0f), 1.0f, ZNear, ZFar);
+		}
+
+		// linear depth of one pose into a 128x128 tile, row 0 at the bottom like glReadPixels, background stays at 1.0
+		void Render(const PoseParameters& pose, float* depth) const
+		{
+			glm::mat4 model, toeRotation, legRotation;
+			ComputePoseMatrices(pose, model, toeRotation, legRotation);
+			glm::mat4 projModel = ProjMat*model;
+			glm::mat4 toe = BoneToMeshToe*toeRotation*MeshToBoneToe;
+			glm::mat4 leg = BoneToMeshLeg*legRotation*MeshToBoneLeg;
+
+			// skinned vertices in window space, w <= 0 marks vertices behind the eye
+			std::vector<glm::vec4>& window = ThreadScratch().Window;
+			for (size_t v = 0; v < positions.size(); v++)
+			{
+				const glm::vec4& weights = boneWeights[v];
+				glm::vec4 skinned = weights.z*(toe*positions[v]) + weights.x*(leg*positions[v]) + (weights.y + weights.w)*positions[v];
+				glm::vec4 clip = projModel*skinned;
+				if (clip.w <= 0.0f)
+				{
+					window[v] = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+					continue;
+				}
+				float invW = 1.0f / clip.w;
+				window[v] = glm::vec4((clip.x*invW + 1.0f)*64.0f, (clip.y*invW + 1.0f)*64.0f, clip.z*invW, 1.0f);
+			}
+
+			std::fill(depth, depth + 128*128, 1.0f);
+			for (size_t i = 0; i + 2 < indices.size(); i += 3)
+			{
+				const glm::vec4& v0 = window[indices[i]];
+				const glm::vec4& v1 = window[indices[i + 1]];
+				const glm::vec4& v2 = window[indices[i + 2]];
+				// triangles crossing the eye plane would need clipping, the tracked foot never gets there
+				if (v0.w < 0.0f || v1.w < 0.0f || v2.w < 0.0f)
+				{
+					continue;
+				}
+				RasterizeTriangle(glm::vec3(v0), glm::vec3(v1), glm::vec3(v2), depth);
+			}
+		}
+
+		// mean |ref - rendered| over the tile, the value the reduction chain ends with
+		float Energy(const PoseParameters& pose, const float* refImg) const
+		{
+			std::vector<float>& depth = ThreadScratch().Depth;
+			Render(pose, depth.data());
+			float energy = 0.0f;
+			for (int y = 0; y < 128; y++)
+			{
+				// the reference is sampled upside down, the same way the subtraction pass does
+				const float* refRow = refImg + (127 - y)*128;
+				energy += AbsDiffSum(refRow, depth.data() + y*128, 128);
+			}
+			return energy / (128.0f*128.0f);
+		}
+
+		// Energy summed in blocks of 8 rows taken in rowOrder, stopping as soon as it is above bound. A stopped sum is a
+		// lower bound of the energy, which is all a particle that cannot improve any best needs. skipped gets the number
+		// of pixels that were never compared.
+		float BoundedEnergy(const PoseParameters& pose, const float* refImg, const int* rowOrder, float bound, int& skipped) const
+		{
+			std::vector<float>& depth = ThreadScratch().Depth;
+			Render(pose, depth.data());
+			const float limit = bound*128.0f*128.0f;
+			float energy = 0.0f;
+			skipped = 0;
+			for (int r = 0; r < 128; r++)
+			{
+				int y = rowOrder[r];
+				energy += AbsDiffSum(refImg + (127 - y)*128, depth.data() + y*128, 128);
+				if ((r & 7) == 7 && energy > limit)
+				{
+					skipped = (127 - r)*128;
+					break;
+				}
+			}
+			return energy / (128.0f*128.0f);
+		}
+
+		// size the scratch buffers of the calling thread, so the first energies it computes do not allocate
+		void Warm() const
+		{
+			ThreadScratch();
+		}
+
+		// energies of a batch of poses, spread over the pool one particle at a time
+		void Energies(const PoseParameters* poses, int count, const float* refImg, float* energies, ThreadPool& pool) const
+		{
+			pool.ParallelFor(count, [&](int p) {
+				energies[p] = Energy(poses[p], refImg);
+			});
+		}
+
+		// bounded energies of a batch of poses, one bound and one skipped count per pose
+		void BoundedEnergies(const PoseParameters* poses, const float* bounds, int count, const float* refImg, const int* rowOrder, float* energies, int* skipped, ThreadPool& pool) const
+		{
+			pool.ParallelFor(count, [&](int p) {
+				energies[p] = BoundedEnergy(poses[p], refImg, rowOrder, bounds[p], skipped[p]);
+			});
+		}
+};
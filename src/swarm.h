@@ -0,0 +1,187 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "pose.h"
+#include "simd.h"
+
+// Particles of the swarm stored as one array per degree of freedom, in PoseParameters member order. Every array is
+// 64 byte aligned and padded to a multiple of 16 particles, so the update runs over whole vectors without remainders.
+class Swarm
+{
+	public:
+		static const int NumDOF = 9;
+
+		int NumParticles;
+		int Stride;
+		float* Position[NumDOF];
+		float* Velocity[NumDOF];
+		float* BestPosition[NumDOF];
+		float* BestEnergy;
+		// uniform random factors of the cognitive and social terms, one per particle
+		float* R1;
+		float* R2;
+
+	private:
+		std::vector<float> storage;
+		// Assuage bounds of the velocities and AssuagePosition bounds of the positions, infinite where nothing is clamped
+		float VelocityLimit[NumDOF];
+		float PositionMin[NumDOF];
+		float PositionMax[NumDOF];
+
+		// v += ((best - x)*c1*r1 + (global - x)*c2*r2)*k clamped to +-limit, then x += v clamped to [min, max]
+		static void UpdateDOFScalar(float* x, float* v, const float* best, const float* r1, const float* r2, int count, float global, float c1, float c2, float k, float limit, float min, float max)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				float velocity = v[i] + ((best[i] - x[i])*c1*r1[i] + (global - x[i])*c2*r2[i])*k;
+				velocity = velocity > limit ? limit : velocity < -limit ? -limit : velocity;
+				float position = x[i] + velocity;
+				v[i] = velocity;
+				x[i] = position < min ? min : position > max ? max : position;
+			}
+		}
+
+#ifdef SIMD_X86
+		__attribute__((target("avx2")))
+		static void UpdateDOFAVX2(float* x, float* v, const float* best, const float* r1, const float* r2, int count, float global, float c1, float c2, float k, float limit, float min, float max)
+		{
+			const __m256 globalV = _mm256_set1_ps(global);
+			const __m256 c1V = _mm256_set1_ps(c1);
+			const __m256 c2V = _mm256_set1_ps(c2);
+			const __m256 kV = _mm256_set1_ps(k);
+			const __m256 limitV = _mm256_set1_ps(limit);
+			const __m256 negLimitV = _mm256_set1_ps(-limit);
+			const __m256 minV = _mm256_set1_ps(min);
+			const __m256 maxV = _mm256_set1_ps(max);
+			// the arrays are padded, so the last vector may run into the padding but never past it
+			for (int i = 0; i < count; i += 8)
+			{
+				__m256 xi = _mm256_load_ps(x + i);
+				__m256 personal = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(best + i), xi), c1V), _mm256_load_ps(r1 + i));
+				__m256 social = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(globalV, xi), c2V), _mm256_load_ps(r2 + i));
+				__m256 velocity = _mm256_add_ps(_mm256_load_ps(v + i), _mm256_mul_ps(_mm256_add_ps(personal, social), kV));
+				velocity = _mm256_max_ps(_mm256_min_ps(velocity, limitV), negLimitV);
+				__m256 position = _mm256_add_ps(xi, velocity);
+				_mm256_store_ps(v + i, velocity);
+				_mm256_store_ps(x + i, _mm256_min_ps(_mm256_max_ps(position, minV), maxV));
+			}
+		}
+#endif
+
+	public:
+		Swarm(int numParticles) : NumParticles{numParticles}
+		{
+			Stride = (NumParticles + 15) & ~15;
+			// 3 arrays per DOF, the best energies and the random factors, plus room to align the start
+			storage.resize((3*NumDOF + 3)*Stride + 16, 0.0f);
+			float* base = storage.data();
+			base += (16 - (reinterpret_cast<std::uintptr_t>(base) / sizeof(float)) % 16) % 16;
+			for (int d = 0; d < NumDOF; d++)
+			{
+				Position[d] = base + d*Stride;
+				Velocity[d] = base + (NumDOF + d)*Stride;
+				BestPosition[d] = base + (2*NumDOF + d)*Stride;
+			}
+			BestEnergy = base + 3*NumDOF*Stride;
+			R1 = base + (3*NumDOF + 1)*Stride;
+			R2 = base + (3*NumDOF + 2)*Stride;
+
+			const float inf = std::numeric_limits<float>::infinity();
+			const float velocityLimit[NumDOF] = {0.01f, 0.01f, 0.01f, 0.05f, 0.05f, 0.05f, inf, inf, inf};
+			const float positionMin[NumDOF] = {-inf, -inf, -inf, -inf, -inf, -inf, glm::radians(-15.0f), glm::radians(-20.0f), glm::radians(-45.0f)};
+			const float positionMax[NumDOF] = {inf, inf, inf, inf, inf, inf, glm::radians(45.0f), glm::radians(45.0f), glm::radians(45.0f)};
+			for (int d = 0; d < NumDOF; d++)
+			{
+				VelocityLimit[d] = velocityLimit[d];
+				PositionMin[d] = positionMin[d];
+				PositionMax[d] = positionMax[d];
+			}
+		}
+
+		// the arrays point into storage, so a copy would alias the original
+		Swarm(const Swarm&) = delete;
+		Swarm& operator=(const Swarm&) = delete;
+
+		// start every particle at its pose with no velocity and no personal best
+		void Initialize(const PoseParameters* poses)
+		{
+			for (int p = 0; p < NumParticles; p++)
+			{
+				SetPosition(p, poses[p]);
+				SetBestPosition(p, poses[p]);
+				BestEnergy[p] = std::numeric_limits<float>::infinity();
+				for (int d = 0; d < NumDOF; d++)
+				{
+					Velocity[d][p] = 0.0f;
+				}
+			}
+		}
+
+		// move every particle to its pose with no velocity, keeping the personal bests for the next frame
+		void Restart(const PoseParameters* poses)
+		{
+			for (int p = 0; p < NumParticles; p++)
+			{
+				SetPosition(p, poses[p]);
+				for (int d = 0; d < NumDOF; d++)
+				{
+					Velocity[d][p] = 0.0f;
+				}
+			}
+		}
+
+		PoseParameters GetPosition(int p) const
+		{
+			return PoseParameters(Position[0][p], Position[1][p], Position[2][p], Position[3][p], Position[4][p], Position[5][p], Position[6][p], Position[7][p], Position[8][p]);
+		}
+
+		PoseParameters GetBestPosition(int p) const
+		{
+			return PoseParameters(BestPosition[0][p], BestPosition[1][p], BestPosition[2][p], BestPosition[3][p], BestPosition[4][p], BestPosition[5][p], BestPosition[6][p], BestPosition[7][p], BestPosition[8][p]);
+		}
+
+		void SetPosition(int p, const PoseParameters& pose)
+		{
+			const float values[NumDOF] = {pose.XTranslation, pose.YTranslation, pose.ZTranslation, pose.XRotation, pose.YRotation, pose.ZRotation, pose.ToeXRot, pose.LegXRot, pose.LegZRot};
+			for (int d = 0; d < NumDOF; d++)
+			{
+				Position[d][p] = values[d];
+			}
+		}
+
+		void SetBestPosition(int p, const PoseParameters& pose)
+		{
+			const float values[NumDOF] = {pose.XTranslation, pose.YTranslation, pose.ZTranslation, pose.XRotation, pose.YRotation, pose.ZRotation, pose.ToeXRot, pose.LegXRot, pose.LegZRot};
+			for (int d = 0; d < NumDOF; d++)
+			{
+				BestPosition[d][p] = values[d];
+			}
+		}
+
+		// constricted velocity and position update of every particle towards its personal best and the global best, with
+		// the Assuage and AssuagePosition clamps, using the random factors in R1 and R2
+		void Update(const PoseParameters& globalBest, float cognitiveConst, float socialConst, float constrictionConst)
+		{
+			typedef void (*UpdateKernel)(float*, float*, const float*, const float*, const float*, int, float, float, float, float, float, float, float);
+			static const UpdateKernel kernel = [] {
+#ifdef SIMD_X86
+				if (GetCPUFeatures().AVX2)
+				{
+					return (UpdateKernel) UpdateDOFAVX2;
+				}
+#endif
+				return (UpdateKernel) UpdateDOFScalar;
+			}();
+
+			const float global[NumDOF] = {globalBest.XTranslation, globalBest.YTranslation, globalBest.ZTranslation, globalBest.XRotation, globalBest.YRotation, globalBest.ZRotation, globalBest.ToeXRot, globalBest.LegXRot, globalBest.LegZRot};
+			for (int d = 0; d < NumDOF; d++)
+			{
+				kernel(Position[d], Velocity[d], BestPosition[d], R1, R2, NumParticles, global[d], cognitiveConst, socialConst, constrictionConst, VelocityLimit[d], PositionMin[d], PositionMax[d]);
+			}
+		}
+};
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#endif
+
+// Fixed set of worker threads that run parallel fors by work stealing. Every thread starts on its own contiguous
+// share of the indices and takes grain sized chunks from the front of it; a thread that runs dry steals the back half
+// of what another thread has left. Workers can be pinned to cores, filling the NUMA node of the creating thread first.
+class ThreadPool
+{
+	private:
+		// indices a thread has left, padded so neighbouring threads do not share a cache line, without alignas since
+		// over-aligned new needs C++17
+		struct WorkRange
+		{
+			std::mutex lock;
+			int Begin;
+			int End;
+			char Padding[64];
+		};
+
+		std::vector<std::thread> workers;
+		std::unique_ptr<WorkRange[]> ranges;
+		std::mutex mutex, submit;
+		std::condition_variable wake, done;
+		// the body of the running parallel for, called through a plain function pointer so no std::function is built
+		void (*invoke)(const void*, int, int);
+		const void* task;
+		int grain;
+		bool stealing;
+		int activeWorkers;
+		unsigned long generation;
+		bool stopping;
+
+		// index of the calling thread in the pool, 0 for the thread that owns it
+		static int& WorkerIndex()
+		{
+			thread_local int index = 0;
+			return index;
+		}
+
+		bool PopChunk(int self, int& begin, int& end)
+		{
+			WorkRange& own = ranges[self];
+			std::lock_guard<std::mutex> lock(own.lock);
+			if (own.Begin >= own.End)
+			{
+				return false;
+			}
+			begin = own.Begin;
+			end = std::min(own.End, begin + grain);
+			own.Begin = end;
+			return true;
+		}
+
+		// move the back half of another thread's indices, at least one chunk, into our own range
+		bool Steal(int self)
+		{
+			int numThreads = Size();
+			for (int k = 1; k < numThreads; k++)
+			{
+				WorkRange& victim = ranges[(self + k) % numThreads];
+				int begin, end;
+				{
+					std::lock_guard<std::mutex> lock(victim.lock);
+					int remaining = victim.End - victim.Begin;
+					if (remaining <= 0)
+					{
+						continue;
+					}
+					int take = std::max(std::min(grain, remaining), remaining / 2);
+					begin = victim.End - take;
+					end = victim.End;
+					victim.End = begin;
+				}
+				std::lock_guard<std::mutex> lock(ranges[self].lock);
+				ranges[self].Begin = begin;
+				ranges[self].End = end;
+				return true;
+			}
+			return false;
+		}
+
+		// run chunks until neither our own range nor anyone else's has indices left
+		void RunTasks(int self)
+		{
+			int begin, end;
+			do
+			{
+				while (PopChunk(self, begin, end))
+				{
+					invoke(task, begin, end);
+				}
+			}
+			while (stealing && Steal(self));
+		}
+
+		void WorkerLoop(int index, int cpu)
+		{
+			WorkerIndex() = index;
+			if (cpu >= 0)
+			{
+				PinCurrentThread(cpu);
+			}
+			unsigned long seen = 0;
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [&] { return stopping || generation != seen; });
+					if (stopping)
+					{
+						return;
+					}
+					seen = generation;
+				}
+				RunTasks(index);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (--activeWorkers == 0)
+					{
+						done.notify_all();
+					}
+				}
+			}
+		}
+
+#ifdef __linux__
+		// CPUs of a sysfs list like "0-3,8-11"
+		static std::vector<int> ParseCPUList(const std::string& list)
+		{
+			std::vector<int> cpus;
+			std::stringstream stream(list);
+			std::string item;
+			while (std::getline(stream, item, ','))
+			{
+				size_t dash = item.find('-');
+				int first = std::stoi(item.substr(0, dash));
+				int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+				for (int cpu = first; cpu <= last; cpu++)
+				{
+					cpus.push_back(cpu);
+				}
+			}
+			return cpus;
+		}
+
+		static void PinCurrentThread(int cpu)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		}
+#else
+		static void PinCurrentThread(int)
+		{
+		}
+#endif
+
+		// CPUs the process may run on, those of the calling thread's NUMA node first and then node by node
+		static std::vector<int> PinningOrder()
+		{
+			std::vector<int> order;
+#ifdef __linux__
+			cpu_set_t allowed;
+			CPU_ZERO(&allowed);
+			if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+			{
+				return order;
+			}
+			std::vector<std::vector<int>> nodes;
+			for (int node = 0; ; node++)
+			{
+				std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+				std::string list;
+				if (!file || !std::getline(file, list))
+				{
+					break;
+				}
+				nodes.push_back(ParseCPUList(list));
+			}
+			int current = sched_getcpu();
+			std::stable_sort(nodes.begin(), nodes.end(), [&](const std::vector<int>& a, const std::vector<int>& b) {
+				return std::find(a.begin(), a.end(), current) != a.end() && std::find(b.begin(), b.end(), current) == b.end();
+			});
+			for (const std::vector<int>& node : nodes)
+			{
+				for (int cpu : node)
+				{
+					if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed) && std::find(order.begin(), order.end(), cpu) == order.end())
+					{
+						order.push_back(cpu);
+					}
+				}
+			}
+			// without NUMA information every allowed CPU is one node
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			{
+				if (CPU_ISSET(cpu, &allowed) && std::find(order.begin(), order.end(), cpu) == order.end())
+				{
+					order.push_back(cpu);
+				}
+			}
+#endif
+			return order;
+		}
+
+	public:
+		// numThreads counts the calling thread, 0 uses every hardware thread. With pinThreads every worker is bound to
+		// one CPU, the calling thread is left alone since it usually owns the GL context.
+		ThreadPool(int numThreads=0, bool pinThreads=false) : invoke{nullptr}, task{nullptr}, grain{1}, stealing{true}, activeWorkers{0}, generation{0}, stopping{false}
+		{
+			if (numThreads <= 0)
+			{
+				numThreads = std::max(1u, std::thread::hardware_concurrency());
+			}
+			ranges.reset(new WorkRange[numThreads]);
+			for (int i = 0; i < numThreads; i++)
+			{
+				ranges[i].Begin = 0;
+				ranges[i].End = 0;
+			}
+			std::vector<int> cpus;
+			if (pinThreads)
+			{
+				cpus = PinningOrder();
+			}
+			for (int i = 1; i < numThreads; i++)
+			{
+				int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+				workers.emplace_back(&ThreadPool::WorkerLoop, this, i, cpu);
+			}
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		~ThreadPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (std::thread& worker : workers)
+			{
+				worker.join();
+			}
+		}
+
+		// Pool shared by every CPU stage, so they do not each spawn their own threads. The arguments only count on the
+		// first call, which creates it.
+		static ThreadPool& Shared(int numThreads=0, bool pinThreads=false)
+		{
+			static ThreadPool pool(numThreads, pinThreads);
+			return pool;
+		}
+
+		int Size() const
+		{
+			return workers.size() + 1;
+		}
+
+		// in [0, Size()) inside a parallel for body, lets the body pick per thread scratch state
+		static int CurrentWorker()
+		{
+			return WorkerIndex();
+		}
+
+		// Run body(begin, end) over chunks of at most grainSize indices covering [0, count), the calling thread helps and
+		// returns once all of them are done. Calls from several threads take turns, a body must not start another one.
+		template <typename Body>
+		void ParallelForRange(int count, int grainSize, const Body& body)
+		{
+			Dispatch(count, grainSize, true, [](const void* context, int begin, int end) {
+				(*static_cast<const Body*>(context))(begin, end);
+			}, &body);
+		}
+
+		// run body(i) for every i in [0, count), grainSize indices are claimed at a time
+		template <typename Body>
+		void ParallelFor(int count, const Body& body, int grainSize=1)
+		{
+			ParallelForRange(count, grainSize, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+				{
+					body(i);
+				}
+			});
+		}
+
+		// run body(worker) exactly once on every thread of the pool, for warming up per thread scratch memory
+		template <typename Body>
+		void ForEachThread(const Body& body)
+		{
+			Dispatch(Size(), 1, false, [](const void* context, int begin, int) {
+				(*static_cast<const Body*>(context))(begin);
+			}, &body);
+		}
+
+	private:
+		// hand every thread its share of [0, count) and run the body until all of it is done
+		void Dispatch(int count, int grainSize, bool steal, void (*function)(const void*, int, int), const void* context)
+		{
+			if (count <= 0)
+			{
+				return;
+			}
+			std::lock_guard<std::mutex> turn(submit);
+			int numThreads = Size();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				invoke = function;
+				task = context;
+				grain = std::max(1, grainSize);
+				stealing = steal;
+				for (int i = 0; i < numThreads; i++)
+				{
+					std::lock_guard<std::mutex> rangeLock(ranges[i].lock);
+					ranges[i].Begin = (int) ((long long) count*i / numThreads);
+					ranges[i].End = (int) ((long long) count*(i + 1) / numThreads);
+				}
+				activeWorkers = workers.size();
+				generation++;
+			}
+			wake.notify_all();
+			RunTasks(0);
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [&] { return activeWorkers == 0; });
+			task = nullptr;
+		}
+};
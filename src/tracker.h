@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "pose.h"
+#include "pso.h"
+#include "random.h"
+
+// How the tracker extrapolates the pose of the next frame from the last ones, frames are taken to be evenly spaced
+enum class MotionModel
+{
+	Static, // the last pose
+	ConstantVelocity, // the last pose plus the motion between the last two
+	ConstantAcceleration // also the change of that motion, from the last three poses
+};
+
+// Settings of a tracking session. Spreads are half widths of uniform boxes around a pose, the joint angles are clipped
+// to their limits.
+struct TrackerSettings
+{
+	MotionModel Motion;
+	// generations of a frame seeded from the initial box, and of a frame seeded around a prediction
+	int InitialIterations;
+	int TrackingIterations;
+	// box of the first frame and of the frame after the track is lost
+	PoseParameters InitialSpread;
+	// the box around a prediction is SpreadGain times the recent mean prediction error, within [MinSpread, InitialSpread]
+	PoseParameters MinSpread;
+	float SpreadGain;
+	// weight of the newest prediction error in that mean
+	float ErrorSmoothing;
+	// a frame with a best energy above this lost the foot and the next one starts over from the initial box, 0 never does
+	float LostEnergy;
+
+	TrackerSettings() :
+		Motion{MotionModel::ConstantVelocity},
+		InitialIterations{20},
+		TrackingIterations{10},
+		InitialSpread(0.05f, 0.05f, 0.05f, 0.3f, 0.3f, 0.3f, glm::radians(30.0f), glm::radians(32.5f), glm::radians(45.0f)),
+		MinSpread(0.002f, 0.002f, 0.002f, 0.01f, 0.01f, 0.01f, 0.02f, 0.02f, 0.02f),
+		SpreadGain{3.0f},
+		ErrorSmoothing{0.5f},
+		LostEnergy{0.0f}
+	{}
+};
+
+// Fill poses with count draws from the box of half widths spread around center, one parameter at a time in member order
+inline void SeedUniform(const PoseParameters& center, const PoseParameters& spread, RandomStream& random, PoseParameters* poses, int count)
+{
+	PoseParameters low = center - spread;
+	PoseParameters high = center + spread;
+	low.AssuagePosition();
+	high.AssuagePosition();
+	for (int i = 0; i < count; i++)
+	{
+		// drawn one statement at a time, argument evaluation order would make the poses compiler dependent
+		float transx = random.Uniform(low.XTranslation, high.XTranslation);
+		float transy = random.Uniform(low.YTranslation, high.YTranslation);
+		float transz = random.Uniform(low.ZTranslation, high.ZTranslation);
+		float rotx = random.Uniform(low.XRotation, high.XRotation);
+		float roty = random.Uniform(low.YRotation, high.YRotation);
+		float rotz = random.Uniform(low.ZRotation, high.ZRotation);
+		float toerotx = random.Uniform(low.ToeXRot, high.ToeXRot);
+		float legrotx = random.Uniform(low.LegXRot, high.LegXRot);
+		float legrotz = random.Uniform(low.LegZRot, high.LegZRot);
+		poses[i] = PoseParameters(transx, transy, transz, rotx, roty, rotz, toerotx, legrotx, legrotz);
+	}
+}
+
+// Tracks the foot through a sequence of depth frames with one PSO whose swarm is carried from frame to frame. The next
+// pose is predicted from the last ones by the motion model and the particles are reseeded around it, in a box that
+// follows how far off the recent predictions were. The personal bests of the last frame are scored again against the
+// new one, so a warm frame starts from a good global best and needs far fewer generations than the first.
+class Tracker
+{
+	public:
+		static const int NumDOF = 9;
+
+	private:
+		PSO& pso;
+		TrackerSettings Settings;
+		RandomStream Random;
+		// pose the initial box is centered on, the last good pose once the track has been lost
+		PoseParameters Center;
+		// poses found in the last frames, newest first, only HistoryLength of them are valid
+		float History[3][NumDOF];
+		int HistoryLength;
+		// running mean of |found - predicted| per parameter
+		float ErrorMean[NumDOF];
+		std::vector<PoseParameters> Seeds;
+		PoseParameters Prediction;
+
+		static void ToArray(const PoseParameters& pose, float* values)
+		{
+			values[0] = pose.XTranslation;
+			values[1] = pose.YTranslation;
+			values[2] = pose.ZTranslation;
+			values[3] = pose.XRotation;
+			values[4] = pose.YRotation;
+			values[5] = pose.ZRotation;
+			values[6] = pose.ToeXRot;
+			values[7] = pose.LegXRot;
+			values[8] = pose.LegZRot;
+		}
+
+		static PoseParameters FromArray(const float* values)
+		{
+			return PoseParameters(values[0], values[1], values[2], values[3], values[4], values[5], values[6], values[7], values[8]);
+		}
+
+		// extrapolate the history, each model falls back to the lower orders while it has too few frames
+		PoseParameters Predict() const
+		{
+			if (HistoryLength == 0)
+			{
+				return Center;
+			}
+			int order = Settings.Motion == MotionModel::ConstantAcceleration ? 2 : Settings.Motion == MotionModel::ConstantVelocity ? 1 : 0;
+			order = std::min(order, HistoryLength - 1);
+			float values[NumDOF];
+			for (int d = 0; d < NumDOF; d++)
+			{
+				float x0 = History[0][d], x1 = History[1][d], x2 = History[2][d];
+				values[d] = order == 2 ? 3.0f*x0 - 3.0f*x1 + x2 : order == 1 ? 2.0f*x0 - x1 : x0;
+			}
+			PoseParameters pose = FromArray(values);
+			pose.AssuagePosition();
+			return pose;
+		}
+
+		// box around the prediction, wide open until the history has shown how good the predictions are
+		PoseParameters Spread() const
+		{
+			float initial[NumDOF], minimum[NumDOF], values[NumDOF];
+			ToArray(Settings.InitialSpread, initial);
+			ToArray(Settings.MinSpread, minimum);
+			for (int d = 0; d < NumDOF; d++)
+			{
+				values[d] = std::max(minimum[d], std::min(initial[d], Settings.SpreadGain*ErrorMean[d]));
+			}
+			return FromArray(values);
+		}
+
+		void ForgetMotion()
+		{
+			HistoryLength = 0;
+			float initial[NumDOF];
+			ToArray(Settings.InitialSpread, initial);
+			for (int d = 0; d < NumDOF; d++)
+			{
+				ErrorMean[d] = initial[d] / Settings.SpreadGain;
+			}
+		}
+
+	public:
+		// track with the swarm of pso, its particle count, stopping criteria and refinement are used as they are set
+		Tracker(PSO& optimizer, const PoseParameters& initialPose, const TrackerSettings& settings=TrackerSettings()) : pso(optimizer), Settings{settings}, Center{initialPose}, History{}, HistoryLength{0}, Seeds(optimizer.GetNumParticles()), Prediction{initialPose}
+		{
+			Settings.SpreadGain = std::max(Settings.SpreadGain, 1e-6f);
+			ForgetMotion();
+		}
+
+		// restart the random numbers of the seeding, the first frame draws the same poses as SeedUniform from this stream
+		void SetSeed(uint64_t seed, uint64_t stream=0)
+		{
+			Random.Seed(seed, stream);
+		}
+
+		// Find the pose in the next 128x128 reference frame, within the deadline if one is given. The first frame and the
+		// one after a lost track start a new swarm from the initial box, the others resume the swarm of the last frame.
+		RunResult Track(float* refImg, std::chrono::high_resolution_clock::time_point deadline=std::chrono::high_resolution_clock::time_point::max())
+		{
+			bool warm = HistoryLength > 0;
+			Prediction = Predict();
+			int numParticles = Seeds.size();
+			if (warm)
+			{
+				// the prediction itself is one of the particles
+				Seeds[0] = Prediction;
+				SeedUniform(Prediction, Spread(), Random, Seeds.data() + 1, numParticles - 1);
+			}
+			else
+			{
+				SeedUniform(Prediction, Settings.InitialSpread, Random, Seeds.data(), numParticles);
+			}
+			RunResult result = pso.Run(Seeds.data(), refImg, warm ? Settings.TrackingIterations : Settings.InitialIterations, deadline, warm);
+
+			if (Settings.LostEnergy > 0.0f && result.Energy > Settings.LostEnergy)
+			{
+				std::cerr << "WARNING: Lost the foot at energy " << result.Energy*128*128 << ", searching the initial box again" << std::endl;
+				if (HistoryLength > 0)
+				{
+					Center = FromArray(History[0]);
+				}
+				ForgetMotion();
+				return result;
+			}
+
+			float found[NumDOF], predicted[NumDOF];
+			ToArray(result.Position, found);
+			ToArray(Prediction, predicted);
+			for (int d = 0; d < NumDOF; d++)
+			{
+				if (warm)
+				{
+					ErrorMean[d] += Settings.ErrorSmoothing*(std::abs(found[d] - predicted[d]) - ErrorMean[d]);
+				}
+				History[2][d] = History[1][d];
+				History[1][d] = History[0][d];
+				History[0][d] = found[d];
+			}
+			HistoryLength = std::min(HistoryLength + 1, 3);
+			return result;
+		}
+
+		// pose the last Track started its particles around
+		const PoseParameters& GetPrediction() const
+		{
+			return Prediction;
+		}
+};